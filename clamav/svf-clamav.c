@@ -27,13 +27,23 @@
 #endif
 #define SVF_DEFAULT_CONNECT_TIMEOUT		30000 /* msec */
 #define SVF_DEFAULT_TIMEOUT			60000 /* msec */
+#define SVF_DEFAULT_SCAN_REQUEST_LIMIT		0
 /* Default values for module-specific configuration variables */
-/* None */
+#define SVF_DEFAULT_SESSION_IDLE_TIMEOUT	10 /* sec */
+
+/* Size of data chunks sent by zINSTREAM */
+#define SVF_CLAMAV_INSTREAM_CHUNK_SIZE		65536
+
+#define SVF_MODULE_CONFIG_MEMBERS \
+	int clamd_session_idle_timeout; \
+	/* End of SVF_MODULE_CONFIG_MEMBERS */
 
 #define svf_module_connect			svf_clamav_connect
+#define svf_module_destruct_config		svf_clamav_destruct_config
 #define svf_module_scan_init			svf_clamav_scan_init
 #define svf_module_scan_end			svf_clamav_scan_end
 #define svf_module_scan				svf_clamav_scan
+#define svf_module_scan_version			svf_clamav_scan_version
 
 #include "svf-vfs.h"
 
@@ -49,10 +59,27 @@ static int svf_clamav_connect(
 	const char *svc,
 	const char *user)
 {
+	int snum = SNUM(vfs_h->conn);
+
 	/* To use clamd "zXXXX" commands */
         svf_io_set_writel_eol(svf_h->io_h, "\0", 1);
         svf_io_set_readl_eol(svf_h->io_h, "\0", 1);
 
+        svf_h->clamd_session_idle_timeout = lp_parm_int(
+		snum, SVF_MODULE_NAME,
+		"session idle timeout",
+		SVF_DEFAULT_SESSION_IDLE_TIMEOUT);
+
+	return 0;
+}
+
+static int svf_clamav_destruct_config(svf_handle *svf_h)
+{
+	/* svf_io_new() may have failed */
+	if (svf_h->io_h) {
+		svf_clamav_scan_end(svf_h);
+	}
+
 	return 0;
 }
 
@@ -61,6 +88,19 @@ static svf_result svf_clamav_scan_init(svf_handle *svf_h)
 	svf_io_handle *io_h = svf_h->io_h;
 	svf_result result;
 
+	if (io_h->socket != -1) {
+		/* clamd closes a session idle for its IdleTimeout (30s) */
+		if (io_h->session &&
+		    time(NULL) < io_h->session_time +
+		    svf_h->clamd_session_idle_timeout) {
+			DEBUG(10,("clamd: Re-using existent session\n"));
+			return SVF_RESULT_OK;
+		}
+
+		DEBUG(7,("clamd: Closing idle connection\n"));
+		svf_clamav_scan_end(svf_h);
+	}
+
 	DEBUG(7,("clamd: Connecting to socket: %s\n", svf_h->socket_path));
 
 	become_root();
@@ -75,6 +115,24 @@ static svf_result svf_clamav_scan_init(svf_handle *svf_h)
 
 	DEBUG(7,("clamd: Connected\n"));
 
+	io_h->session_request_count = 0;
+	io_h->session_time = time(NULL);
+
+	if (svf_h->clamd_session_idle_timeout <= 0) {
+		/* One command per connection */
+		return SVF_RESULT_OK;
+	}
+
+	/* Replies are prefixed by "<request number>: " in a session */
+	if (svf_io_writefl(io_h, "zIDSESSION") != SVF_RESULT_OK) {
+		DEBUG(0,("clamd: zIDSESSION: I/O error: %s\n", strerror(errno)));
+		svf_io_disconnect(io_h);
+		return SVF_RESULT_ERROR;
+	}
+	io_h->session = true;
+
+	DEBUG(10,("clamd: Session started\n"));
+
 	return SVF_RESULT_OK;
 }
 
@@ -82,11 +140,245 @@ static void svf_clamav_scan_end(svf_handle *svf_h)
 {
 	svf_io_handle *io_h = svf_h->io_h;
 
+	if (io_h->socket == -1) {
+		io_h->session = false;
+		return;
+	}
+
 	DEBUG(7,("clamd: Disconnecting\n"));
 
+	if (io_h->session) {
+		/* clamd may have closed it already: Ignore errors */
+		svf_io_writefl(io_h, "zEND");
+		io_h->session = false;
+	}
+
 	svf_io_disconnect(io_h);
 }
 
+/* Send the content of a file after zINSTREAM as <LENGTH><DATA> chunks
+   ended by a zero length chunk */
+static svf_result svf_clamav_stream(svf_io_handle *io_h, int fd)
+{
+	char *chunk;
+	ssize_t read_size;
+	uint32_t len;
+	svf_result result = SVF_RESULT_ERROR;
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		return SVF_RESULT_ERROR;
+	}
+
+	chunk = talloc_size(talloc_tos(), 4 + SVF_CLAMAV_INSTREAM_CHUNK_SIZE);
+	if (!chunk) {
+		errno = ENOMEM;
+		return SVF_RESULT_ERROR;
+	}
+
+	for (;;) {
+		read_size = read(fd, chunk + 4, SVF_CLAMAV_INSTREAM_CHUNK_SIZE);
+		if (read_size == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		len = htonl((uint32_t)read_size);
+		memcpy(chunk, &len, 4);
+		if (svf_io_write(io_h, chunk, 4 + read_size) != SVF_RESULT_OK) {
+			break;
+		}
+		if (read_size == 0) {
+			result = SVF_RESULT_OK;
+			break;
+		}
+	}
+
+	TALLOC_FREE(chunk);
+
+	return result;
+}
+
+/* Send a command followed by the content of stream_fd if not -1 */
+static svf_result svf_clamav_vsend(
+	svf_handle *svf_h,
+	int stream_fd,
+	uint32_t *idp,
+	const char *fmt,
+	va_list ap)
+{
+	svf_io_handle *io_h = svf_h->io_h;
+	svf_result result;
+
+	*idp = 0;
+	if (io_h->session) {
+		*idp = svf_io_request_vsend(io_h, fmt, ap);
+		result = (*idp != 0) ? SVF_RESULT_OK : SVF_RESULT_ERROR;
+	} else {
+		result = svf_io_vwritefl(io_h, fmt, ap);
+	}
+	if (result == SVF_RESULT_OK && stream_fd != -1) {
+		result = svf_clamav_stream(io_h, stream_fd);
+	}
+
+	return result;
+}
+
+static svf_result svf_clamav_send(
+	svf_handle *svf_h,
+	int stream_fd,
+	uint32_t *idp,
+	const char *fmt, ...)
+{
+	va_list ap;
+	svf_result result;
+
+	va_start(ap, fmt);
+	result = svf_clamav_vsend(svf_h, stream_fd, idp, fmt, ap);
+	va_end(ap);
+
+	return result;
+}
+
+/* Return the reply to a command without the session prefix */
+static char *svf_clamav_recv(svf_handle *svf_h, uint32_t id)
+{
+	svf_io_handle *io_h = svf_h->io_h;
+	svf_result result;
+
+	if (io_h->session) {
+		/* The reply must be to the request just sent */
+		result = svf_io_request_recv(io_h, id);
+	} else {
+		result = svf_io_readl(io_h);
+		if (result == SVF_RESULT_OK && io_h->r_size == 0) { /* EOF */
+			errno = ECONNRESET;
+			result = SVF_RESULT_ERROR;
+		}
+	}
+	if (result != SVF_RESULT_OK) {
+		return NULL;
+	}
+
+	io_h->session_request_count++;
+	io_h->session_time = time(NULL);
+
+	return io_h->session ? io_h->reply : io_h->r_buffer;
+}
+
+static char *svf_clamav_request(
+	svf_handle *svf_h,
+	int stream_fd,
+	const char *fmt, ...)
+{
+	va_list ap;
+	svf_result result;
+	uint32_t id;
+
+	va_start(ap, fmt);
+	result = svf_clamav_vsend(svf_h, stream_fd, &id, fmt, ap);
+	va_end(ap);
+	if (result != SVF_RESULT_OK) {
+		return NULL;
+	}
+
+	return svf_clamav_recv(svf_h, id);
+}
+
+/* Send a command, and send it again to another clamd if no reply came
+   within the hedge delay. Returns the first reply. */
+static char *svf_clamav_request_hedged(
+	svf_handle *svf_h,
+	int stream_fd,
+	const char *command)
+{
+	int delay = svf_hedge_delay(svf_h);
+	svf_io_handle *io_hs[2];
+	svf_hedge hedge;
+	uint32_t id, hedge_id;
+	int ready;
+
+	if (delay < 0) {
+		return svf_clamav_request(svf_h, stream_fd, "%s", command);
+	}
+
+	if (svf_clamav_send(svf_h, stream_fd, &id, "%s", command)
+	    != SVF_RESULT_OK) {
+		return NULL;
+	}
+
+	io_hs[0] = svf_h->io_h;
+	if (svf_io_poll_readable(io_hs, 1, delay) != -1 ||
+	    errno != ETIMEDOUT || !svf_hedge_start(svf_h, &hedge)) {
+		return svf_clamav_recv(svf_h, id);
+	}
+
+	/* svf_h->io_h is the connection to the other clamd now */
+	if (svf_io_path_is_tcp(hedge.socket_path) != (stream_fd != -1)) {
+		/* zSCAN and zINSTREAM cannot be mixed */
+		svf_hedge_finish(svf_h, &hedge, false, false);
+		return svf_clamav_recv(svf_h, id);
+	}
+	if (svf_clamav_scan_init(svf_h) != SVF_RESULT_OK ||
+	    svf_clamav_send(svf_h, stream_fd, &hedge_id, "%s", command)
+	    != SVF_RESULT_OK) {
+		DEBUG(3,("clamd: Hedged request failed: %s: %s\n",
+			hedge.socket_path, strerror(errno)));
+		svf_hedge_finish(svf_h, &hedge, false, false);
+		return svf_clamav_recv(svf_h, id);
+	}
+
+	io_hs[0] = hedge.primary_io_h;
+	io_hs[1] = hedge.io_h;
+	ready = svf_io_poll_readable(io_hs, 2, svf_h->io_timeout);
+	if (ready == -1) {
+		int saved_errno = errno;
+
+		/* Neither answered within "io timeout": Do not wait again */
+		DEBUG(3,("clamd: Hedged request: No reply: %s: %s\n",
+			hedge.primary_socket_path, strerror(saved_errno)));
+		svf_hedge_finish(svf_h, &hedge, true, false);
+		svf_h->io_h->io_error = true;
+		errno = saved_errno;
+		return NULL;
+	}
+	svf_hedge_finish(svf_h, &hedge, true, ready == 1);
+
+	return svf_clamav_recv(svf_h, (ready == 1) ? hedge_id : id);
+}
+
+static char *svf_clamav_scan_version(TALLOC_CTX *mem_ctx, svf_handle *svf_h)
+{
+	svf_io_handle *io_h = svf_h->io_h;
+	char *reply;
+
+	if (svf_clamav_scan_init(svf_h) != SVF_RESULT_OK) {
+		return NULL;
+	}
+
+	reply = svf_clamav_request(svf_h, -1, "zVERSION");
+	if (!reply) {
+		DEBUG(0,("clamd: zVERSION: I/O error: %s\n", strerror(errno)));
+		svf_clamav_scan_end(svf_h);
+		return NULL;
+	}
+
+	/* ClamAV <ENGINE VERSION>/<DB VERSION>/<DB DATE> */
+	if (!strn_eq(reply, "ClamAV ", 7)) {
+		DEBUG(0,("clamd: zVERSION: Invalid reply: %s\n", reply));
+		svf_clamav_scan_end(svf_h);
+		return NULL;
+	}
+
+	DEBUG(7,("clamd: Version: %s\n", reply));
+
+	if (!io_h->session) {
+		svf_clamav_scan_end(svf_h);
+	}
+
+	return talloc_strdup(mem_ctx, reply);
+}
+
 static svf_result svf_clamav_scan(
 	vfs_handle_struct *vfs_h,
 	svf_handle *svf_h,
@@ -97,6 +389,7 @@ static svf_result svf_clamav_scan(
 	const char *fname = smb_fname->base_name;
 	size_t filepath_len = strlen(connectpath) + 1 /* slash */ + strlen(fname);
 	svf_io_handle *io_h = svf_h->io_h;
+	int stream_fd = -1;
 	svf_result result = SVF_RESULT_CLEAN;
 	char *report = NULL;
 	char *reply;
@@ -104,33 +397,76 @@ static svf_result svf_clamav_scan(
 
 	DEBUG(7,("Scanning file: %s/%s\n", connectpath, fname));
 
-	if (svf_io_writefl_readl(io_h, "zSCAN %s/%s",
-	    connectpath, fname) != SVF_RESULT_OK) {
+	if (svf_io_path_is_tcp(svf_h->socket_path)) {
+		/* clamd on another host cannot open the file: Send its content */
+		char *filepath = talloc_asprintf(talloc_tos(), "%s/%s",
+			connectpath, fname);
+		stream_fd = filepath ? open(filepath, O_RDONLY|O_NOCTTY) : -1;
+		TALLOC_FREE(filepath);
+		if (stream_fd == -1) {
+			DEBUG(0,("clamd: Opening file failed: %s/%s: %s\n",
+				connectpath, fname, strerror(errno)));
+			result = SVF_RESULT_ERROR;
+			report = talloc_asprintf(talloc_tos(),
+				"Opening file failed: %s\n", strerror(errno));
+			goto svf_clamav_scan_return;
+		}
+		/* stream: <REPORT> */
+		filepath_len = 6;
+		reply = svf_clamav_request_hedged(svf_h, stream_fd, "zINSTREAM");
+	} else {
+		char *command = talloc_asprintf(talloc_tos(), "zSCAN %s/%s",
+			connectpath, fname);
+		reply = command ?
+			svf_clamav_request_hedged(svf_h, -1, command) : NULL;
+		TALLOC_FREE(command);
+	}
+	/* A hedged request may have been answered by another clamd */
+	io_h = svf_h->io_h;
+	if (!reply && io_h->session &&
+	    io_h->session_request_count > 0 && errno != ETIMEDOUT) {
+		/* clamd may have ended the session (e.g., restarted) */
+		DEBUG(3,("clamd: zSCAN: Session lost: %s: Retrying\n",
+			strerror(errno)));
+		svf_clamav_scan_end(svf_h);
+		if (svf_clamav_scan_init(svf_h) == SVF_RESULT_OK) {
+			if (stream_fd != -1) {
+				reply = svf_clamav_request(svf_h, stream_fd,
+					"zINSTREAM");
+			} else {
+				reply = svf_clamav_request(svf_h, -1,
+					"zSCAN %s/%s", connectpath, fname);
+			}
+		}
+	}
+	if (!reply) {
 		DEBUG(0,("clamd: zSCAN: I/O error: %s\n", strerror(errno)));
 		result = SVF_RESULT_ERROR;
 		report = talloc_asprintf(talloc_tos(),
 			"Scanner I/O error: %s\n", strerror(errno));
+		svf_clamav_scan_end(svf_h);
 		goto svf_clamav_scan_return;
 	}
 
-	if (io_h->r_buffer[filepath_len] != ':' || io_h->r_buffer[filepath_len+1] != ' ') {
-		DEBUG(0,("clamd: zSCAN: Invalid reply: %s\n", io_h->r_buffer));
+	if (strlen(reply) < filepath_len + 2 ||
+	    reply[filepath_len] != ':' || reply[filepath_len+1] != ' ') {
+		DEBUG(0,("clamd: zSCAN: Invalid reply: %s\n", reply));
 		result = SVF_RESULT_ERROR;
 		report = "Scanner communication error";
+		svf_clamav_scan_end(svf_h);
 		goto svf_clamav_scan_return;
 	}
-	reply = io_h->r_buffer + filepath_len + 2;
+	reply += filepath_len + 2;
 
-	reply_token = strrchr(io_h->r_buffer, ' ');
+	reply_token = strrchr(reply, ' ');
 	if (!reply_token) {
-		DEBUG(0,("clamd: zSCAN: Invalid reply: %s\n", io_h->r_buffer));
+		DEBUG(0,("clamd: zSCAN: Invalid reply: %s\n", reply));
 		result = SVF_RESULT_ERROR;
 		report = "Scanner communication error";
 		goto svf_clamav_scan_return;
 	}
 	*reply_token = '\0';
 	reply_token++;
-
 	if (str_eq(reply_token, "OK") ) {
 		/* <FILEPATH>: OK */
 		result = SVF_RESULT_CLEAN;
@@ -152,6 +488,13 @@ static svf_result svf_clamav_scan(
 	}
 
 svf_clamav_scan_return:
+	if (stream_fd != -1) {
+		close(stream_fd);
+	}
+	if (!io_h->session) {
+		svf_clamav_scan_end(svf_h);
+	}
+
 	*reportp = report;
 
 	return result;
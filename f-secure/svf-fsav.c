@@ -38,6 +38,7 @@
 	bool scan_riskware; \
 	bool stop_scan_on_first; \
 	bool filter_filename; \
+	char *fsav_dbversion; \
 	/* End of SVF_MODULE_CONFIG_MEMBERS */
 
 #define svf_module_connect			svf_fsav_connect
@@ -45,6 +46,8 @@
 #define svf_module_scan_init			svf_fsav_scan_init
 #define svf_module_scan_end			svf_fsav_scan_end
 #define svf_module_scan				svf_fsav_scan
+#define svf_module_scan_version			svf_fsav_scan_version
+#define svf_module_io_pool_tag			svf_fsav_io_pool_tag
 
 #include "svf-vfs.h"
 
@@ -92,12 +95,26 @@ static int svf_fsav_destruct_config(svf_handle *svf_h)
 	return 0;
 }
 
+static char *svf_fsav_io_pool_tag(TALLOC_CTX *mem_ctx, svf_handle *svf_h)
+{
+	return talloc_asprintf(mem_ctx, "p%dr%ds%df%d",
+		svf_h->fsav_protocol,
+		(int)svf_h->scan_riskware,
+		(int)svf_h->stop_scan_on_first,
+		(int)svf_h->filter_filename);
+}
+
 static svf_result svf_fsav_scan_init(svf_handle *svf_h)
 {
 	svf_io_handle *io_h = svf_h->io_h;
 	svf_result result;
 
 	if (io_h->socket != -1) {
+		if (svf_io_is_alive(io_h, svf_h->ping_interval)) {
+			DEBUG(10,("fsavd: Re-using recently used connection\n"));
+			return SVF_RESULT_OK;
+		}
+
 		DEBUG(10,("fsavd: Checking if connection is alive\n"));
 
 		/* FIXME: I don't know the correct PING command format... */
@@ -133,6 +150,9 @@ static svf_result svf_fsav_scan_init(svf_handle *svf_h)
 		goto svf_fsav_init_failed;
 	}
 
+	TALLOC_FREE(svf_h->fsav_dbversion);
+	svf_h->fsav_dbversion = talloc_strdup(svf_h, io_h->r_buffer + 10);
+
 	DEBUG(10,("fsavd: Connected\n"));
 
 	DEBUG(7,("fsavd: Configuring\n"));
@@ -245,6 +265,22 @@ static void svf_fsav_scan_end(svf_handle *svf_h)
 	svf_io_disconnect(io_h);
 }
 
+static char *svf_fsav_scan_version(TALLOC_CTX *mem_ctx, svf_handle *svf_h)
+{
+	/* fsavd tells the DB version only in the greeting message */
+	svf_fsav_scan_end(svf_h);
+	if (svf_fsav_scan_init(svf_h) != SVF_RESULT_OK) {
+		return NULL;
+	}
+	if (!svf_h->fsav_dbversion) {
+		return NULL;
+	}
+
+	DEBUG(7,("fsavd: DB version: %s\n", svf_h->fsav_dbversion));
+
+	return talloc_strdup(mem_ctx, svf_h->fsav_dbversion);
+}
+
 static svf_result svf_fsav_scan(
 	vfs_handle_struct *vfs_h,
 	svf_handle *svf_h,
@@ -257,15 +293,20 @@ static svf_result svf_fsav_scan(
 	svf_result result = SVF_RESULT_CLEAN;
 	const char *report = NULL;
 	char *reply_token, *reply_saveptr;
+	bool retry = true;
 
 	DEBUG(7,("Scanning file: %s/%s\n", connectpath, fname));
 
+svf_fsav_scan_send:
 	if (svf_io_writevl(io_h,
 	    "SCAN\t", 5,
 	    connectpath, (int)strlen(connectpath),
 	    "/", 1,
 	    fname, (int)strlen(fname),
 	    NULL) != SVF_RESULT_OK) {
+		if (retry && io_h->peer_closed) {
+			goto svf_fsav_scan_reconnect;
+		}
 		DEBUG(0,("fsavd: SCAN: Write error: %s\n", strerror(errno)));
 		result = SVF_RESULT_ERROR;
 		report = talloc_asprintf(talloc_tos(),
@@ -274,7 +315,13 @@ static svf_result svf_fsav_scan(
 	}
 
 	for (;;) {
-		if (svf_io_readl(io_h) != SVF_RESULT_OK) {
+		if (svf_io_readl(io_h) != SVF_RESULT_OK || io_h->peer_closed) {
+			if (retry && io_h->peer_closed) {
+				goto svf_fsav_scan_reconnect;
+			}
+			if (io_h->peer_closed) { /* EOF */
+				errno = ECONNRESET;
+			}
 			DEBUG(0,("fsavd: SCANFILE: Read error: %s\n",
 				strerror(errno)));
 			result = SVF_RESULT_ERROR;
@@ -282,6 +329,8 @@ static svf_result svf_fsav_scan(
 				"Scanner I/O error: %s\n", strerror(errno));
 			break;
 		}
+		/* Not safe to send again once fsavd has replied */
+		retry = false;
 
 		reply_token = strtok_r(io_h->r_buffer, "\t", &reply_saveptr);
 
@@ -341,5 +390,18 @@ svf_fsav_scan_return:
 	*reportp = report;
 
 	return result;
+
+svf_fsav_scan_reconnect:
+	/* Closed by fsavd while idle: Nothing was scanned, so send again */
+	DEBUG(3,("fsavd: SCAN: Connection closed by scanner: Retrying\n"));
+	retry = false;
+	svf_fsav_scan_end(svf_h);
+	if (svf_fsav_scan_init(svf_h) != SVF_RESULT_OK) {
+		result = SVF_RESULT_ERROR;
+		report = talloc_asprintf(talloc_tos(),
+			"Scanner I/O error: %s\n", strerror(errno));
+		goto svf_fsav_scan_return;
+	}
+	goto svf_fsav_scan_send;
 }
 
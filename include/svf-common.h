@@ -21,6 +21,7 @@
 
 /* Samba common include file */
 #include "includes.h"
+#include "../lib/crypto/crypto.h"
 
 #if SAMBA_VERSION_NUMBER >= 30600
 #  include "smbd/smbd.h"
@@ -30,6 +31,8 @@
 #  include "auth.h"
 #  include "passdb.h"
 #  include "../librpc/gen_ndr/ndr_netlogon.h"
+#  include "lib/util/tdb_wrap.h"
+#  include "dbwrap.h"
 #endif
 
 #if (SMB_VFS_INTERFACE_VERSION < 27)
@@ -88,6 +91,14 @@ typedef enum {
 #  define conn_client_addr(conn, addr)	(client_addr(get_client_fd(), (addr), sizeof(addr)))
 #endif
 
+#if SAMBA_VERSION_NUMBER >= 30600
+#  define svf_messaging_context()	server_messaging_context()
+#  define svf_event_context()		server_event_context()
+#else
+#  define svf_messaging_context()	smbd_messaging_context()
+#  define svf_event_context()		smbd_event_context()
+#endif
+
 #define conn_server_addr(conn, addr)	client_socket_addr(conn_socket(conn), (addr), sizeof(addr));
 
 #endif /* _SVF_COMMON_H */
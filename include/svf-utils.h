@@ -28,11 +28,17 @@
 #define SVF_IO_BUFFER_SIZE	(SVF_IO_URL_MAX + 128)
 #define SVF_IO_EOL_SIZE		2
 #define SVF_IO_IOV_MAX		16
+#define SVF_IO_TCP_URL_PREFIX	"tcp://"
+#define SVF_IO_POLL_MAX		4
 
 typedef struct svf_io_handle {
+	struct svf_io_handle *prev, *next;
 	int		socket;
 	int		connect_timeout;	/* msec */
 	int		io_timeout;		/* msec */
+	bool		has_deadline;
+	struct timeval	deadline;		/* of the current request */
+	bool		deadline_expired;
 	char		w_eol[SVF_IO_EOL_SIZE];	/* end-of-line character(s) */
 	int		w_eol_size;
 	char		r_eol[SVF_IO_EOL_SIZE];	/* end-of-line character(s) */
@@ -42,24 +48,289 @@ typedef struct svf_io_handle {
 	ssize_t		r_size;
 	char		*r_rest_buffer;
 	ssize_t		r_rest_size;
+	/* Numbered requests: Replies are prefixed by "<id>: " */
+	uint32_t	request_id;		/* of the last request sent */
+	char		*reply;			/* set by svf_io_request_recv() */
+	/* Connection pool: Shared by the connections with the same key */
+	char		*pool_key;
+	bool		pool_busy;
+	int		pool_error_count;	/* consecutive failed scans */
+	bool		io_error;		/* since connected */
+	bool		peer_closed;		/* EOF, EPIPE or ECONNRESET */
+	time_t		last_io_time;		/* of the last data received */
+	/* Scanner session state belongs to the socket, not to a share */
+	bool		session;
+	int		session_request_count;
+	int		scan_request_count;	/* since connected */
+	time_t		session_time;
 } svf_io_handle;
 
+#define SVF_BACKEND_MAGIC		0x53564642 /* "SVFB" */
+#define SVF_BACKEND_SLOT_NUM		1024
+
+/* State of a scanner backend shared by smbd processes, by the hash of
+   its socket path. Collisions only skew the load balancing. */
+typedef struct {
+	volatile uint32_t	outstanding;	/* scans in progress */
+	volatile uint32_t	error_count;	/* consecutive failures */
+	volatile uint32_t	open_until;	/* time_t, 0 if closed */
+	volatile uint32_t	probe_until;	/* time_t of the probe deadline */
+} svf_backend_slot;
+
+/* Circuit breaker of a backend */
+typedef enum {
+	SVF_BACKEND_CLOSED,	/* scans go to the backend */
+	SVF_BACKEND_OPEN,	/* scans fail fast */
+	SVF_BACKEND_HALF_OPEN,	/* the next scan probes the backend */
+} svf_backend_state;
+
+typedef enum {
+	SVF_BACKEND_EVENT_NONE,
+	SVF_BACKEND_EVENT_TRIPPED,	/* closed -> open */
+	SVF_BACKEND_EVENT_RESET,	/* half-open -> closed */
+} svf_backend_event;
+
+/* Shared memory region mapped by all smbd processes */
+typedef struct {
+	uint32_t	magic;
+	uint32_t	data_size;
+} svf_shm_header;
+
+typedef struct {
+	void		*map;
+	size_t		map_size;
+	void		*data;		/* right after svf_shm_header */
+	size_t		data_size;
+} svf_shm_handle;
+
+typedef struct {
+	svf_shm_handle		*shm_h;		/* NULL if local to the process */
+	svf_backend_slot	*slots;
+	uint32_t		slot_num;	/* power of 2 */
+} svf_backend_table_handle;
+
+#define SVF_CACHE_HASH_SIZE_MIN	64
+#define SVF_CACHE_HASH_SIZE_MAX	(1 << 24)
+/* Do not trust a validator of a file changed within this period (sec) */
+#define SVF_CACHE_VALIDATOR_RACY_TIME	2
+/* Slots of the timing wheels to expire entries: The fine wheel has a
+   slot per second, and the coarse one a slot per round of it */
+#define SVF_CACHE_WHEEL_SIZE		64	/* power of 2 */
+/* Entries allocated at once */
+#define SVF_CACHE_SLAB_SIZE		64
+/* Names shorter than this are stored in the entry (fits a hex digest) */
+#define SVF_CACHE_FNAME_INLINE_SIZE	80
+#define SVF_CACHE_REPORT_HASH_SIZE	64	/* power of 2 */
+/* Max credit of an entry to survive eviction */
+#define SVF_CACHE_CREDIT_MAX		15
+/* Cost level of a scan: log2(msec), 0 to this */
+#define SVF_CACHE_COST_LEVEL_MAX	7
+
+struct svf_cache_handle;
+struct svf_cache_slab;
+
+/* Directory of cached files to invalidate a subtree at once */
+typedef struct svf_cache_dir {
+	struct svf_cache_dir *parent;	/* NULL for the top directory */
+	/* Hash chain keyed by the parent and name */
+	struct svf_cache_dir *hash_next, **hash_pprev;
+	uint32_t hash;
+	int ref_count;	/* entries and child directories */
+	bool dead;	/* renamed or removed */
+	int name_len;
+	char name[1];	/* NUL-terminated, allocated with the struct */
+} svf_cache_dir;
+
+/* Interned report string shared by entries */
+typedef struct svf_cache_report {
+	struct svf_cache_report *next;
+	uint32_t hash;
+	int ref_count;
+	char str[1];	/* NUL-terminated, allocated with the struct */
+} svf_cache_report;
+
 typedef struct svf_cache_entry {
+	struct svf_cache_handle *cache_h;
+	struct svf_cache_slab *slab;	/* allocated from */
 	struct svf_cache_entry *prev, *next;
+	/* Hash chain (hash_pprev points to previous hash_next) */
+	struct svf_cache_entry *hash_next, **hash_pprev;
+	/* Timing wheel chain (wheel_pprev points to previous wheel_next) */
+	struct svf_cache_entry *wheel_next, **wheel_pprev;
+	/* Directory of the file (NULL for the top directory) */
+	svf_cache_dir *dir;
 	time_t time;
-	char *fname;
+	time_t expire;	/* 0 means never */
+	size_t mem_size;	/* counted in the size limit */
+	char *fname;	/* fname_inline or allocated */
 	int fname_len;
+	uint32_t fname_hash;
 	svf_result result;
-	const char *report;
+	/* Eviction: Hits add credit weighted by the cost of the scan */
+	uint8_t cost_level;
+	uint8_t credit;
+	const char *report;	/* str in svf_cache_report, set by svf_cache_entry_set_report() */
+	/* Version of the scanner's signature database */
+	uint32_t generation;
+	/* Invalidation counter of the file when it was scanned */
+	bool has_inval_seq;
+	uint32_t inval_seq;
+	/* Validator: Identity and state of the file when it was scanned */
+	bool has_validator;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	char fname_inline[SVF_CACHE_FNAME_INLINE_SIZE];
 } svf_cache_entry;
 
+/* Entries allocated at once, freed when all of them are unused */
+typedef struct svf_cache_slab {
+	struct svf_cache_slab *prev, *next;	/* with unused entries */
+	svf_cache_entry *free_list;	/* chained by hash_next */
+	int used_num;
+	svf_cache_entry entries[SVF_CACHE_SLAB_SIZE];
+} svf_cache_slab;
+
+typedef enum {
+	SVF_CACHE_BACKEND_LOCAL,
+	SVF_CACHE_BACKEND_SHM,
+	SVF_CACHE_BACKEND_TDB,
+	SVF_CACHE_BACKEND_DBWRAP,
+} svf_cache_backend;
+
+/* Lifetime and visibility of the in-process scan result cache */
+typedef enum {
+	SVF_CACHE_SCOPE_CONNECTION,
+	SVF_CACHE_SCOPE_PROCESS,
+} svf_cache_scope;
+
+/* Max length of a report imported from a cache backend */
+#define SVF_CACHE_REPORT_MAX		256
+
+#define SVF_SHM_CACHE_MAGIC		0x53564632 /* "SVF2" */
+#define SVF_SHM_CACHE_REPORT_SIZE	64
+#define SVF_SHM_CACHE_PROBE_MAX		8
+
+/* Open-addressed slot in the shared cache, guarded by a seqlock */
 typedef struct {
+	volatile uint32_t	seq;	/* odd while being updated */
+	uint32_t		result;
+	uint32_t		generation;
+	uint64_t		dev;
+	uint64_t		ino;
+	int64_t			size;
+	int64_t			mtime_sec, mtime_nsec;
+	int64_t			ctime_sec, ctime_nsec;
+	int64_t			time;
+	char			report[SVF_SHM_CACHE_REPORT_SIZE];
+} svf_shm_cache_slot;
+
+typedef struct {
+	svf_shm_handle		*shm_h;
+	svf_shm_cache_slot	*slots;
+	uint32_t		slot_num;	/* power of 2 */
+} svf_shm_cache_handle;
+
+#define SVF_CACHE_INVAL_MAGIC		0x53564649 /* "SVFI" */
+#define SVF_CACHE_INVAL_COUNTER_NUM	65536
+
+/* Counters bumped by any smbd process that changes a file, by the hash
+   of the device and inode. Collisions only cause extra rescans. */
+typedef struct {
+	svf_shm_handle		*shm_h;
+	volatile uint32_t	*counters;
+	uint32_t		counter_num;	/* power of 2 */
+} svf_cache_inval_handle;
+
+#define SVF_TDB_CACHE_VERSION		2
+/* Compact the cache file by one of smbd processes every N seconds */
+#define SVF_TDB_CACHE_COMPACT_INTERVAL	3600
+#define SVF_TDB_CACHE_COMPACT_CHECK_INTERVAL	60
+#define SVF_TDB_CACHE_COMPACT_KEY	"SVF/COMPACT_TIME"
+
+/* Persistent cache record keyed by device and inode */
+typedef struct {
+	uint32_t		version;
+	uint32_t		result;
+	uint32_t		generation;
+	int64_t			size;
+	int64_t			mtime_sec, mtime_nsec;
+	int64_t			ctime_sec, ctime_nsec;
+	int64_t			time;
+	/* NUL-terminated report follows */
+} svf_tdb_cache_record;
+
+typedef struct {
+	struct tdb_wrap		*tdb_w;
+	struct db_context	*db;		/* instead of tdb_w if not NULL */
+	char			*path;
+	off_t			size_limit;	/* bytes, 0 means no limit */
+} svf_tdb_cache_handle;
+
+typedef struct svf_cache_handle {
 	svf_cache_entry *list, *end;
+	svf_cache_entry **hash_table;
+	uint32_t hash_size;	/* power of 2 */
 	int entry_num;
 	int entry_limit;
 	time_t time_limit;
+	size_t mem_size;
+	size_t size_limit;	/* bytes, 0 means no limit */
+	/* Max age by result (sec), 0: Not cached, < 0: No limit */
+	time_t clean_time_limit;
+	time_t infected_time_limit;
+	time_t error_time_limit;
+	/* Clock sampled once per request */
+	time_t time_now;
+	/* Entries to expire, by the second of the expiry time (due within
+	   SVF_CACHE_WHEEL_SIZE sec), by the round of the fine wheel (due
+	   within SVF_CACHE_WHEEL_SIZE rounds), or later */
+	svf_cache_entry *wheel[SVF_CACHE_WHEEL_SIZE];
+	svf_cache_entry *wheel_coarse[SVF_CACHE_WHEEL_SIZE];
+	svf_cache_entry *wheel_far;
+	time_t wheel_time;	/* next second to process */
+	/* Version of the scanner's signature database (0 if unknown) */
+	uint32_t generation;
+	/* Slabs with unused entries */
+	svf_cache_slab *slabs;
+	svf_cache_report *report_table[SVF_CACHE_REPORT_HASH_SIZE];
+	/* Directories of entries */
+	svf_cache_dir **dir_table;
+	uint32_t dir_hash_size;	/* power of 2 */
+	int dir_num;
+	/* Shared caches behind this cache (optional) */
+	svf_shm_cache_handle *shm_cache_h;
+	svf_tdb_cache_handle *tdb_cache_h;
+	/* Invalidation by other processes (optional) */
+	svf_cache_inval_handle *inval_h;
 } svf_cache_handle;
 
+/* Content hash (SHA-256) */
+#define SVF_DIGEST_SIZE			SHA256_DIGEST_LENGTH
+#define SVF_DIGEST_HEX_SIZE		(SVF_DIGEST_SIZE * 2 + 1)
+#define SVF_DIGEST_READ_SIZE		(256 * 1024)
+
+/* Clean scan result stored in an extended attribute of the file */
+#define SVF_XATTR_VERDICT_VERSION	2
+#define SVF_XATTR_KEY_SIZE		32
+/* Setting the signed xattr right after the stamped ctime updates ctime
+   within this period (nsec): Coarse timestamps may tick in between */
+#define SVF_XATTR_CTIME_SLACK_NSEC	100000000
+
+typedef struct {
+	uint32_t	version;
+	uint32_t	generation;
+	char		engine[16];
+	uint64_t	ino;
+	int64_t		size;
+	int64_t		mtime_sec, mtime_nsec;
+	/* Set by the file system (its clock) just before the xattr */
+	int64_t		ctime_sec, ctime_nsec;
+	uint8_t		mac[SVF_DIGEST_SIZE];	/* HMAC-SHA256 of the above */
+} svf_xattr_verdict;
+
 typedef struct {
 	char		**env_list;
 	size_t		env_size;
@@ -83,10 +354,13 @@ int svf_vfs_next_move(
 svf_io_handle *svf_io_new(TALLOC_CTX *mem_ctx, int connect_timeout, int timeout);
 int svf_io_set_connect_timeout(svf_io_handle *io_h, int timeout);
 int svf_io_set_io_timeout(svf_io_handle *io_h, int timeout);
+void svf_io_set_deadline(svf_io_handle *io_h, int msec);
 void svf_io_set_writel_eol(svf_io_handle *io_h, const char *eol, int eol_size);
 void svf_io_set_readl_eol(svf_io_handle *io_h, const char *eol, int eol_size);
+bool svf_io_path_is_tcp(const char *path);
 svf_result svf_io_connect_path(svf_io_handle *io_h, const char *path);
 svf_result svf_io_disconnect(svf_io_handle *io_h);
+bool svf_io_is_alive(svf_io_handle *io_h, int idle_time);
 svf_result svf_io_write(svf_io_handle *io_h, const char *data, size_t data_size);
 svf_result svf_io_writel(svf_io_handle *io_h, const char *data, size_t data_size);
 svf_result svf_io_writefl(svf_io_handle *io_h, const char *data_fmt, ...);
@@ -95,15 +369,61 @@ svf_result svf_io_writev(svf_io_handle *io_h, ...);
 svf_result svf_io_writevl(svf_io_handle *io_h, ...);
 svf_result svf_io_readl(svf_io_handle *io_h);
 svf_result svf_io_writefl_readl(svf_io_handle *io_h, const char *fmt, ...);
+int svf_io_poll_readable(svf_io_handle **io_hs, int io_h_num, int timeout);
+void svf_io_request_reset(svf_io_handle *io_h);
+uint32_t svf_io_request_vsend(svf_io_handle *io_h, const char *fmt, va_list ap);
+svf_result svf_io_request_recv(svf_io_handle *io_h, uint32_t id);
+
+/* Shared memory */
+svf_shm_handle *svf_shm_new(TALLOC_CTX *mem_ctx, const char *path, uint32_t magic, size_t data_size);
+
+/* Scanner backends */
+svf_backend_table_handle *svf_backend_table_new(TALLOC_CTX *mem_ctx, const char *path);
+svf_backend_slot *svf_backend_slot_get(svf_backend_table_handle *table_h, const char *path);
+svf_backend_state svf_backend_state_get(svf_backend_slot *slot);
+int svf_backend_select(svf_backend_table_handle *table_h, const char **paths, int path_num, int exclude, int retry_interval);
+void svf_backend_begin(svf_backend_slot *slot);
+void svf_backend_cancel(svf_backend_slot *slot);
+svf_backend_event svf_backend_end(svf_backend_slot *slot, bool failed, int error_limit, int retry_interval);
 
 /* Scan result cache */
 svf_cache_handle *svf_cache_new(TALLOC_CTX *ctx, int entry_limit, time_t time_limit);
+void svf_cache_set_limits(svf_cache_handle *cache_h, int entry_limit, time_t time_limit);
+void svf_cache_set_size_limit(svf_cache_handle *cache_h, size_t size_limit);
+void svf_cache_set_result_time_limits(svf_cache_handle *cache_h, time_t clean_time_limit, time_t infected_time_limit, time_t error_time_limit);
 svf_cache_entry *svf_cache_entry_new(svf_cache_handle *cache_h, const char *fname, int fname_len);
-svf_cache_entry *svf_cache_entry_rename(svf_cache_entry *cache_e, const char *fname, int fname_len);
-#define svf_cache_entry_free(cache_e) TALLOC_FREE(cache_e)
-svf_cache_entry *svf_cache_get(svf_cache_handle *cache_h, const char *fname, int fname_len);
-void svf_cache_add(svf_cache_handle *cache_h, svf_cache_entry *cache_e);
+svf_cache_entry *svf_cache_entry_rename(svf_cache_handle *cache_h, svf_cache_entry *cache_e, const char *fname, int fname_len);
+void svf_cache_entry_free(svf_cache_entry *cache_e);
+bool svf_cache_entry_set_report(svf_cache_entry *cache_e, const char *report);
+void svf_cache_entry_set_cost(svf_cache_entry *cache_e, int64_t scan_usec);
+void svf_cache_entry_set_validator(svf_cache_entry *cache_e, const SMB_STRUCT_STAT *st);
+void svf_cache_entry_set_inval_seq(svf_cache_entry *cache_e, const SMB_STRUCT_STAT *st, uint32_t inval_seq);
+svf_cache_entry *svf_cache_get(svf_cache_handle *cache_h, const char *fname, int fname_len, const SMB_STRUCT_STAT *st, const char *options);
+void svf_cache_add(svf_cache_handle *cache_h, svf_cache_entry *cache_e, const char *options);
 void svf_cache_remove(svf_cache_handle *cache_h, svf_cache_entry *cache_e);
+void svf_cache_flush(svf_cache_handle *cache_h);
+void svf_cache_remove_dir(svf_cache_handle *cache_h, const char *dname);
+bool svf_cache_set_version(svf_cache_handle *cache_h, const char *version);
+uint32_t svf_cache_shared_generation(const svf_cache_handle *cache_h, const char *options);
+svf_shm_cache_handle *svf_shm_cache_new(TALLOC_CTX *mem_ctx, const char *path, int entry_limit);
+void svf_cache_set_shm(svf_cache_handle *cache_h, svf_shm_cache_handle *shm_cache_h);
+svf_cache_inval_handle *svf_cache_inval_new(TALLOC_CTX *mem_ctx, const char *path);
+void svf_cache_set_inval(svf_cache_handle *cache_h, svf_cache_inval_handle *inval_h);
+uint32_t svf_cache_inval_seq(svf_cache_handle *cache_h, const SMB_STRUCT_STAT *st);
+void svf_cache_invalidate(svf_cache_inval_handle *inval_h, const SMB_STRUCT_STAT *st);
+svf_tdb_cache_handle *svf_tdb_cache_new(TALLOC_CTX *mem_ctx, const char *path, off_t size_limit);
+svf_tdb_cache_handle *svf_db_cache_new(TALLOC_CTX *mem_ctx, const char *path, off_t size_limit);
+int svf_tdb_cache_compact(svf_tdb_cache_handle *tdb_cache_h);
+void svf_tdb_cache_compact_if_due(svf_tdb_cache_handle *tdb_cache_h);
+void svf_cache_set_tdb(svf_cache_handle *cache_h, svf_tdb_cache_handle *tdb_cache_h);
+
+/* Content hash */
+int svf_file_digest(const char *path, const SMB_STRUCT_STAT *st, char *hex);
+
+/* Scan result in extended attribute */
+int svf_xattr_key_load(const char *path, uint8_t *key);
+void svf_xattr_verdict_set(svf_xattr_verdict *verdict, const uint8_t *key, const char *engine, uint32_t generation, const SMB_STRUCT_STAT *st);
+bool svf_xattr_verdict_check(const svf_xattr_verdict *verdict, const uint8_t *key, const char *engine, uint32_t generation, const SMB_STRUCT_STAT *st);
 
 /* Environment variable handling for execle(2) */
 svf_env_struct *svf_env_new(TALLOC_CTX *ctx);
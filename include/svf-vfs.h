@@ -35,6 +35,21 @@
 
 #define SVF_DEFAULT_CACHE_ENTRY_LIMIT		100
 #define SVF_DEFAULT_CACHE_TIME_LIMIT		10
+#define SVF_DEFAULT_CACHE_SIZE_LIMIT		0
+#define SVF_DEFAULT_CACHE_CLEAN_TIME_LIMIT	-1
+#define SVF_DEFAULT_CACHE_INFECTED_TIME_LIMIT	-1
+#define SVF_DEFAULT_CACHE_ERROR_TIME_LIMIT	0
+#define SVF_DEFAULT_CACHE_BACKEND		SVF_CACHE_BACKEND_LOCAL
+#define SVF_DEFAULT_CACHE_SCOPE			SVF_CACHE_SCOPE_CONNECTION
+#define SVF_DEFAULT_CACHE_SHM_ENTRY_LIMIT	65536
+#define SVF_DEFAULT_CACHE_TDB_SIZE_LIMIT	100000000L /* 100MB */
+#define SVF_DEFAULT_CACHE_CONTENT_HASH		false
+#define SVF_DEFAULT_CACHE_CONTENT_HASH_TIME_LIMIT 3600
+#define SVF_DEFAULT_CACHE_SIGNATURE_CHECK_INTERVAL 60
+#define SVF_DEFAULT_CACHE_INVALIDATION		false
+#define SVF_DEFAULT_CACHE_XATTR			false
+#define SVF_DEFAULT_CACHE_XATTR_NAME		"trusted." SVF_MODULE_NAME
+#define SVF_DEFAULT_CACHE_XATTR_KEY_FILE	NULL
 
 #define SVF_DEFAULT_INFECTED_FILE_ACTION	SVF_ACTION_DO_NOTHING
 #define SVF_DEFAULT_INFECTED_FILE_COMMAND	NULL
@@ -49,6 +64,17 @@
 #define SVF_DEFAULT_QUARANTINE_DIRECTORY	VARDIR "/svf/quarantine"
 #define SVF_DEFAULT_QUARANTINE_PREFIX		"svf."
 
+#define SVF_DEFAULT_CONNECTION_POOL_SIZE	4
+#define SVF_DEFAULT_BACKEND_ERROR_LIMIT		2
+#define SVF_DEFAULT_BACKEND_RETRY_INTERVAL	10 /* sec */
+#define SVF_DEFAULT_HEDGE_PERCENTILE		0
+#define SVF_DEFAULT_HEDGE_MIN_DELAY		100 /* msec */
+#define SVF_DEFAULT_ADAPTIVE_IO_TIMEOUT		false
+#define SVF_DEFAULT_ADAPTIVE_IO_TIMEOUT_PERCENTILE 99
+#define SVF_DEFAULT_ADAPTIVE_IO_TIMEOUT_FACTOR	4
+#define SVF_DEFAULT_ADAPTIVE_IO_TIMEOUT_MIN	1000 /* msec */
+#define SVF_DEFAULT_PING_INTERVAL		10 /* sec */
+
 /* ====================================================================== */
 
 int svf_debug_level = DBGC_VFS;
@@ -62,9 +88,44 @@ static const struct enum_list svf_actions[] = {
 	{ -1,				NULL}
 };
 
-typedef struct {
+static const struct enum_list svf_cache_backends[] = {
+	{ SVF_CACHE_BACKEND_LOCAL,	"local" },
+	{ SVF_CACHE_BACKEND_SHM,	"shm" },
+	{ SVF_CACHE_BACKEND_TDB,	"tdb" },
+	{ SVF_CACHE_BACKEND_DBWRAP,	"dbwrap" },
+	{ -1,				NULL}
+};
+
+static const struct enum_list svf_cache_scopes[] = {
+	{ SVF_CACHE_SCOPE_CONNECTION,	"connection" },
+	{ SVF_CACHE_SCOPE_PROCESS,	"process" },
+	{ -1,				NULL}
+};
+
+/* Caches shared by all connections in this process (if enabled) */
+static svf_cache_handle *svf_process_cache_h = NULL;
+static svf_cache_handle *svf_process_digest_cache_h = NULL;
+/* Next version check of the caches above */
+static time_t svf_process_version_check_time = 0;
+/* Mapping of the cache shared by all smbd processes (if enabled) */
+static svf_shm_cache_handle *svf_shm_cache_h = NULL;
+/* Persistent cache shared by all smbd processes (if enabled) */
+static svf_tdb_cache_handle *svf_tdb_cache_h = NULL;
+/* Cache shared by all cluster nodes (if enabled) */
+static svf_tdb_cache_handle *svf_db_cache_h = NULL;
+/* Compaction of the persistent or cluster cache */
+static struct tevent_timer *svf_tdb_cache_compact_te = NULL;
+/* Invalidation of cached results by all smbd processes (if enabled) */
+static svf_cache_inval_handle *svf_cache_inval_h = NULL;
+/* Key to sign scan results in extended attributes (if enabled) */
+static uint8_t svf_xattr_key[SVF_XATTR_KEY_SIZE];
+static bool svf_xattr_key_loaded = false;
+
+typedef struct svf_handle {
+	/* All connections in this process */
+	struct svf_handle		*prev, *next;
+	vfs_handle_struct		*vfs_h;
 #ifdef SVF_DEFAULT_SCAN_REQUEST_LIMIT
-	int				scan_request_count;
 	int				scan_request_limit;
 #endif
 	/* Scan on file operations */
@@ -89,6 +150,29 @@ typedef struct {
 	svf_cache_handle		*cache_h;
 	int				cache_entry_limit;
 	int				cache_time_limit;
+	size_t				cache_size_limit;
+	int				cache_clean_time_limit;
+	int				cache_infected_time_limit;
+	int				cache_error_time_limit;
+	svf_cache_backend		cache_backend;
+	svf_cache_scope			cache_scope;
+	/* Scan options of results shared with other shares or processes */
+	char *				cache_options_tag;
+	/* Prepended to cache keys in a cache shared with other shares */
+	char *				cache_key_prefix;
+	char *				cache_digest_key_prefix;
+	/* Scan result cache keyed by content hash */
+	svf_cache_handle		*digest_cache_h;
+	bool				cache_content_hash;
+	int				cache_content_hash_time_limit;
+	/* Flush the caches when the signature database is updated */
+	int				cache_signature_check_interval;
+	time_t				scan_version_check_time;
+	/* Keep clean scan results in extended attributes of files */
+	bool				cache_xattr;
+	const char *			cache_xattr_name;
+	/* Flush the caches when changed by reloading the configuration */
+	char *				cache_flush_token;
 	/* Infected file options */
 	svf_action			infected_file_action;
 	const char *			infected_file_command;
@@ -104,15 +188,90 @@ typedef struct {
 	const char *			quarantine_prefix;
 	/* Network options */
 #ifdef SVF_DEFAULT_SOCKET_PATH
-        const char *			socket_path;
-	svf_io_handle			*io_h;
+        const char *			socket_path;	/* in use */
+	/* Scanner backends ("socket path" list) */
+	const char **			socket_paths;
+	int				socket_path_num;
+	int				backend_error_limit;
+	int				backend_retry_interval;
+	/* Hedged requests to another backend for slow scans */
+	int				hedge_percentile;
+	int				hedge_min_delay;	/* msec */
+	int				hedge_count;
+	int				hedge_won_count;
+	/* Backend that answered the current scan instead of the first one */
+	svf_backend_slot		*hedge_won_slot;
+	int64_t				hedge_won_usec;	/* its latency */
+	/* Scan deadline from the latency of recent scans of similar size */
+	bool				adaptive_io_timeout;
+	int				adaptive_io_timeout_percentile;
+	int				adaptive_io_timeout_factor;
+	int				adaptive_io_timeout_min;	/* msec */
+	int				connect_timeout;
+	int				io_timeout;
+	int				ping_interval;	/* sec */
+	svf_io_handle			*io_h;		/* in use */
+	/* Scanner connection pool shared by the connections in this process */
+	svf_io_handle			*io_private_h;	/* if not pooled */
+	int				io_pool_size;
+	char *				io_pool_key;
 #endif
+	/* Statistics */
+	int				hash_count;
+	int				hash_hit_count;
+	off_t				hash_bytes;
+	int64_t				hash_usec;
+	int				scan_count;
+	off_t				scan_bytes;
+	int64_t				scan_usec;
 	/* Module specific configuration options */
 #ifdef SVF_MODULE_CONFIG_MEMBERS
 	SVF_MODULE_CONFIG_MEMBERS
 #endif
 } svf_handle;
 
+/* All connections in this process, to reload the configuration */
+static svf_handle *svf_handles = NULL;
+static struct tevent_timer *svf_reload_te = NULL;
+
+#ifdef SVF_DEFAULT_SOCKET_PATH
+/* Scanner connections of this process, idle or checked out */
+static svf_io_handle *svf_io_pool = NULL;
+static svf_backend_table_handle *svf_backend_table_h = NULL;
+
+/* Recent scan latencies of this process, for the hedge delay */
+#define SVF_HEDGE_SAMPLE_NUM		256
+#define SVF_HEDGE_DELAY_UPDATE_INTERVAL	32	/* samples */
+static int64_t svf_hedge_samples[SVF_HEDGE_SAMPLE_NUM];
+static int svf_hedge_sample_count = 0;
+static int svf_hedge_delay_percentile = -1;
+static int svf_hedge_delay_usec = 0;
+
+/* Recent scan latencies of this process per backend and file size */
+#define SVF_LATENCY_BUCKET_NUM		5	/* <4K, <64K, <1M, <16M, more */
+#define SVF_LATENCY_SAMPLE_NUM		64
+#define SVF_LATENCY_SAMPLE_MIN		16	/* to trust the percentile */
+typedef struct svf_latency_model {
+	struct svf_latency_model	*prev, *next;
+	char				*socket_path;
+	struct {
+		int64_t			samples[SVF_LATENCY_SAMPLE_NUM];
+		int			sample_count;
+	} buckets[SVF_LATENCY_BUCKET_NUM];
+} svf_latency_model;
+static svf_latency_model *svf_latency_models = NULL;
+
+/* A request sent to a second backend while the first one is slow */
+typedef struct {
+	svf_io_handle			*primary_io_h;
+	const char			*primary_socket_path;
+	svf_io_handle			*io_h;
+	const char			*socket_path;
+	svf_backend_slot		*slot;
+	struct timeval			start_time;
+} svf_hedge;
+#endif
+
 /* ====================================================================== */
 
 #ifdef svf_module_connect
@@ -139,6 +298,16 @@ static svf_result svf_module_scan_init(svf_handle *svf_h);
 static void svf_module_scan_end(svf_handle *svf_h);
 #endif
 
+#ifdef svf_module_io_pool_tag
+/* Return a tag of the options negotiated with the scanner on connecting */
+static char *svf_module_io_pool_tag(TALLOC_CTX *mem_ctx, svf_handle *svf_h);
+#endif
+
+#ifdef svf_module_scan_version
+/* Return the version of the scanner and its signature database */
+static char *svf_module_scan_version(TALLOC_CTX *mem_ctx, svf_handle *svf_h);
+#endif
+
 static svf_result svf_module_scan(
 	vfs_handle_struct *vfs_h,
 	svf_handle *svf_h,
@@ -149,6 +318,8 @@ static svf_result svf_module_scan(
 
 static int svf_destruct_config(svf_handle *svf_h)
 {
+	DLIST_REMOVE(svf_handles, svf_h);
+
 #ifdef svf_module_destruct_config
 	/* FIXME: Check return code */
 	svf_module_destruct_config(svf_h);
@@ -157,32 +328,616 @@ static int svf_destruct_config(svf_handle *svf_h)
 	return 0;
 }
 
-static int svf_vfs_connect(
-	vfs_handle_struct *vfs_h,
-	const char *svc,
-	const char *user)
+static void svf_cache_set_limits_by_handle(
+	svf_cache_handle *cache_h,
+	svf_handle *svf_h,
+	int time_limit)
 {
-	int snum = SNUM(vfs_h->conn);
-	svf_handle *svf_h;
-	char *exclude_files;
+	svf_cache_set_limits(cache_h, svf_h->cache_entry_limit, time_limit);
+	svf_cache_set_size_limit(cache_h, svf_h->cache_size_limit);
+	svf_cache_set_result_time_limits(cache_h,
+		svf_h->cache_clean_time_limit,
+		svf_h->cache_infected_time_limit,
+		svf_h->cache_error_time_limit);
+}
+
+static svf_cache_handle *svf_cache_new_by_handle(
+	TALLOC_CTX *mem_ctx,
+	svf_handle *svf_h,
+	int time_limit)
+{
+	svf_cache_handle *cache_h;
+
+	cache_h = svf_cache_new(mem_ctx,
+		svf_h->cache_entry_limit, time_limit);
+	if (!cache_h) {
+		return NULL;
+	}
+
+	svf_cache_set_limits_by_handle(cache_h, svf_h, time_limit);
+
+	return cache_h;
+}
+
+/* Results from a process-wide cache are valid only for connections
+   that scan with the same options */
+static char *svf_cache_scan_options_tag(
+	TALLOC_CTX *mem_ctx,
+	svf_handle *svf_h)
+{
+	char *tag = talloc_strdup(mem_ctx, "");
+
+#ifdef SVF_DEFAULT_SCAN_ARCHIVE
+	if (tag) {
+		tag = talloc_asprintf_append(tag, "a%d",
+			(int)svf_h->scan_archive);
+	}
+#endif
+#ifdef SVF_DEFAULT_MAX_NESTED_SCAN_ARCHIVE
+	if (tag) {
+		tag = talloc_asprintf_append(tag, "n%d",
+			svf_h->max_nested_scan_archive);
+	}
+#endif
+#ifdef SVF_DEFAULT_SCAN_MIME
+	if (tag) {
+		tag = talloc_asprintf_append(tag, "m%d",
+			(int)svf_h->scan_mime);
+	}
+#endif
+#ifdef svf_module_io_pool_tag
+	/* Module options (e.g., "scan riskware") */
+	if (tag) {
+		char *module_tag = svf_module_io_pool_tag(tag, svf_h);
+
+		tag = module_tag ? talloc_asprintf_append(tag, "%s",
+			module_tag) : NULL;
+	}
+#endif
+	if (tag) {
+		tag = talloc_asprintf_append(tag, ":");
+	}
+
+	return tag;
+}
+
+static bool svf_cache_options_tag_set(svf_handle *svf_h)
+{
+	char *tag;
+
+	tag = svf_cache_scan_options_tag(svf_h, svf_h);
+	if (!tag) {
+		return false;
+	}
+
+	TALLOC_FREE(svf_h->cache_options_tag);
+	svf_h->cache_options_tag = tag;
+
+	return true;
+}
+
+static bool svf_cache_key_prefix_set(svf_handle *svf_h)
+{
+	char *digest_key_prefix;
+	char *key_prefix;
+
+	digest_key_prefix = svf_cache_scan_options_tag(svf_h, svf_h);
+	if (!digest_key_prefix) {
+		return false;
+	}
+	key_prefix = talloc_asprintf(svf_h, "%s%s/",
+		digest_key_prefix, svf_h->vfs_h->conn->connectpath);
+	if (!key_prefix) {
+		TALLOC_FREE(digest_key_prefix);
+		return false;
+	}
+
+	TALLOC_FREE(svf_h->cache_digest_key_prefix);
+	TALLOC_FREE(svf_h->cache_key_prefix);
+	svf_h->cache_digest_key_prefix = digest_key_prefix;
+	svf_h->cache_key_prefix = key_prefix;
+
+	return true;
+}
+
+/* Return the cache key for a file name or a digest, NULL on error */
+static const char *svf_cache_key(
+	const char *prefix,
+	const char *name)
+{
+	if (!prefix) {
+		return name;
+	}
+
+	return talloc_asprintf(talloc_tos(), "%s%s", prefix, name);
+}
+
+/* Scanner connection pool
+ * ====================================================================== */
+
 #ifdef SVF_DEFAULT_SOCKET_PATH
-	int connect_timeout, io_timeout;
+/* Connections are shared only by shares using the same scanner with
+   the same options: The key is the options tag followed by the socket
+   path of the backend */
+static bool svf_io_pool_key_set(svf_handle *svf_h)
+{
+	char *tag;
+
+	/* Includes the options the module negotiates */
+	tag = svf_cache_scan_options_tag(talloc_tos(), svf_h);
+	if (!tag) {
+		return false;
+	}
+
+	TALLOC_FREE(svf_h->io_pool_key);
+	svf_h->io_pool_key = talloc_steal(svf_h, tag);
+
+	return true;
+}
+
+/* Use a pooled connection for the next scanner requests, preferring an
+   already connected and configured one */
+static void svf_io_pool_checkout(svf_handle *svf_h)
+{
+	svf_io_handle *io_h;
+	svf_io_handle *found = NULL;
+	char *key;
+
+	if (svf_h->io_pool_size <= 0 || !svf_h->io_pool_key ||
+	    svf_h->io_h != svf_h->io_private_h) {
+		return;
+	}
+
+	key = talloc_asprintf(talloc_tos(), "%s%s",
+		svf_h->io_pool_key, svf_h->socket_path);
+	if (!key) {
+		DEBUG(0,("talloc_asprintf failed: Connection not pooled\n"));
+		return;
+	}
+
+	for (io_h = svf_io_pool; io_h; io_h = io_h->next) {
+		if (io_h->pool_busy || !str_eq(io_h->pool_key, key)) {
+			continue;
+		}
+		if (io_h->socket != -1) {
+			found = io_h;
+			break;
+		}
+		if (!found) {
+			found = io_h;
+		}
+	}
+
+	if (!found) {
+		/* Outlives the connection: Freed at process exit */
+		found = svf_io_new(NULL,
+			svf_h->connect_timeout, svf_h->io_timeout);
+		if (!found) {
+			DEBUG(0,("svf_io_new failed: Connection not pooled\n"));
+			return;
+		}
+		found->pool_key = talloc_steal(found, key);
+		svf_io_set_writel_eol(found, svf_h->io_private_h->w_eol,
+			svf_h->io_private_h->w_eol_size);
+		svf_io_set_readl_eol(found, svf_h->io_private_h->r_eol,
+			svf_h->io_private_h->r_eol_size);
+		DLIST_ADD_END(svf_io_pool, found, svf_io_handle *);
+		DEBUG(10,("New pooled connection: %s\n", found->pool_key));
+	} else {
+		svf_io_set_connect_timeout(found, svf_h->connect_timeout);
+		svf_io_set_io_timeout(found, svf_h->io_timeout);
+	}
+
+	TALLOC_FREE(key);
+
+	/* Left by a cancelled hedged request */
+	svf_io_set_deadline(found, 0);
+	found->pool_busy = true;
+	svf_h->io_h = found;
+}
+
+/* Return a pooled connection. Keep at most "connection pool size"
+   connections per key, and drop the connection after a failure */
+static void svf_io_pool_checkin(svf_handle *svf_h, bool failed)
+{
+	svf_io_handle *io_h = svf_h->io_h;
+	svf_io_handle *io_h2;
+	int count = 0;
+
+	if (io_h == svf_h->io_private_h) {
+		return;
+	}
+
+	if (failed) {
+		io_h->pool_error_count++;
+		DEBUG(io_h->pool_error_count > 1 ? 3 : 10,
+			("Pooled connection failed %d times in a row: %s\n",
+			io_h->pool_error_count, io_h->pool_key));
+	} else {
+		io_h->pool_error_count = 0;
+	}
+
+	for (io_h2 = svf_io_pool; io_h2; io_h2 = io_h2->next) {
+		if (io_h2 != io_h && !io_h2->pool_busy &&
+		    str_eq(io_h2->pool_key, io_h->pool_key)) {
+			count++;
+		}
+	}
+
+	if (io_h->socket != -1 && (failed || count >= svf_h->io_pool_size)) {
+#ifdef svf_module_scan_end
+		svf_module_scan_end(svf_h);
+#else
+		svf_io_disconnect(io_h);
 #endif
+	}
 
+	svf_h->io_h = svf_h->io_private_h;
+	io_h->pool_busy = false;
 
-	svf_h = TALLOC_ZERO_P(vfs_h, svf_handle);
-	if (!svf_h) {
-		DEBUG(0, ("TALLOC_ZERO_P failed\n"));
+	if (count >= svf_h->io_pool_size) {
+		DLIST_REMOVE(svf_io_pool, io_h);
+		TALLOC_FREE(io_h);
+	}
+}
+
+/* Close the idle pooled connections: The scanner or the options may
+   have changed */
+static void svf_io_pool_flush(svf_handle *svf_h)
+{
+	svf_io_handle *io_h, *io_h_next;
+
+	for (io_h = svf_io_pool; io_h; io_h = io_h_next) {
+		io_h_next = io_h->next;
+		if (io_h->pool_busy) {
+			continue;
+		}
+		svf_h->io_h = io_h;
+#ifdef svf_module_scan_end
+		svf_module_scan_end(svf_h);
+#else
+		svf_io_disconnect(io_h);
+#endif
+		DLIST_REMOVE(svf_io_pool, io_h);
+		TALLOC_FREE(io_h);
+	}
+
+	svf_h->io_h = svf_h->io_private_h;
+}
+
+/* Scanner backends and their circuit breakers
+ * ---------------------------------------------------------------------- */
+
+/* Return true if scans go through the shared backend state: to balance
+   them over several backends, or for the circuit breaker */
+static bool svf_backend_table_use(svf_handle *svf_h)
+{
+	if (svf_h->socket_path_num == 0 ||
+	    (svf_h->socket_path_num == 1 && svf_h->backend_error_limit <= 0)) {
+		return false;
+	}
+
+	if (!svf_backend_table_h) {
+		/* Outlives the connection: Freed at process exit */
+		svf_backend_table_h = svf_backend_table_new(NULL,
+			lock_path(SVF_MODULE_NAME ".backends"));
+	}
+
+	return (svf_backend_table_h != NULL);
+}
+
+static void svf_backend_switch(svf_handle *svf_h, int backend)
+{
+	if (svf_h->socket_path == svf_h->socket_paths[backend]) {
+		return;
+	}
+
+	/* Not pooled: Connected to another backend */
+#ifdef svf_module_scan_end
+	svf_module_scan_end(svf_h);
+#else
+	svf_io_disconnect(svf_h->io_h);
+#endif
+	svf_h->socket_path = svf_h->socket_paths[backend];
+}
+
+/* Use a backend whose circuit breaker is closed for a request other
+   than a scan. Returns false if there is none: Probes are left to
+   scans. */
+static bool svf_backend_choose_closed(svf_handle *svf_h)
+{
+	int i;
+
+	if (!svf_backend_table_use(svf_h)) {
+		return true;
+	}
+
+	for (i = 0; i < svf_h->socket_path_num; i++) {
+		svf_backend_slot *slot = svf_backend_slot_get(
+			svf_backend_table_h, svf_h->socket_paths[i]);
+		if (svf_backend_state_get(slot) == SVF_BACKEND_CLOSED) {
+			svf_backend_switch(svf_h, i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void svf_backend_end_log(
+	svf_handle *svf_h,
+	svf_backend_slot *slot,
+	const char *socket_path,
+	bool failed)
+{
+	switch (svf_backend_end(slot, failed, svf_h->backend_error_limit,
+	    svf_h->backend_retry_interval)) {
+	case SVF_BACKEND_EVENT_TRIPPED:
+		DEBUG(0,("Scanner backend failed %d times: %s: "
+			"Circuit breaker open for %d sec\n",
+			svf_h->backend_error_limit, socket_path,
+			svf_h->backend_retry_interval));
+		break;
+	case SVF_BACKEND_EVENT_RESET:
+		DEBUG(0,("Scanner backend recovered: %s: "
+			"Circuit breaker closed\n", socket_path));
+		break;
+	case SVF_BACKEND_EVENT_NONE:
+		break;
+	}
+}
+
+/* Hedged requests
+ * ---------------------------------------------------------------------- */
+
+static void svf_hedge_sample_add(int64_t usec)
+{
+	svf_hedge_samples[svf_hedge_sample_count % SVF_HEDGE_SAMPLE_NUM] = usec;
+	svf_hedge_sample_count++;
+}
+
+static int svf_hedge_sample_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/* Return the time (msec) to wait for a reply before hedging: The scan
+   latency at "hedge percentile" but at least "hedge min delay", or -1
+   if hedging is disabled */
+static int svf_hedge_delay(svf_handle *svf_h)
+{
+	int64_t sorted[SVF_HEDGE_SAMPLE_NUM];
+	int n;
+	int delay;
+
+	if (svf_h->hedge_percentile <= 0 || svf_h->hedge_percentile > 100 ||
+	    svf_h->socket_path_num < 2 || svf_h->io_pool_size <= 0 ||
+	    !svf_backend_table_h || svf_h->io_h == svf_h->io_private_h) {
 		return -1;
 	}
 
-	talloc_set_destructor(svf_h, svf_destruct_config);
+	n = MIN(svf_hedge_sample_count, SVF_HEDGE_SAMPLE_NUM);
+	if (n > 0 && (svf_hedge_delay_percentile != svf_h->hedge_percentile ||
+	    svf_hedge_sample_count % SVF_HEDGE_DELAY_UPDATE_INTERVAL == 0)) {
+		memcpy(sorted, svf_hedge_samples, n * sizeof(sorted[0]));
+		qsort(sorted, n, sizeof(sorted[0]), svf_hedge_sample_cmp);
+		svf_hedge_delay_usec = sorted[(n - 1) *
+			svf_h->hedge_percentile / 100];
+		svf_hedge_delay_percentile = svf_h->hedge_percentile;
+	}
 
-	SMB_VFS_HANDLE_SET_DATA(vfs_h,
-		svf_h,
-		NULL,
-		svf_handle,
-		return -1);
+	delay = svf_hedge_delay_usec / 1000;
+
+	return MAX(delay, svf_h->hedge_min_delay);
+}
+
+/* Switch svf_h->io_h to a pooled connection to another backend. The
+   module then initializes it and sends the same request again. */
+static bool svf_hedge_start(svf_handle *svf_h, svf_hedge *hedge)
+{
+	int current;
+	int backend;
+
+	for (current = 0; current < svf_h->socket_path_num; current++) {
+		if (svf_h->socket_paths[current] == svf_h->socket_path) {
+			break;
+		}
+	}
+	backend = svf_backend_select(svf_backend_table_h,
+		svf_h->socket_paths, svf_h->socket_path_num,
+		current, svf_h->backend_retry_interval);
+	if (backend == -1) {
+		return false;
+	}
+
+	ZERO_STRUCTP(hedge);
+	hedge->primary_io_h = svf_h->io_h;
+	hedge->primary_socket_path = svf_h->socket_path;
+
+	svf_h->io_h = svf_h->io_private_h;
+	svf_h->socket_path = svf_h->socket_paths[backend];
+	svf_io_pool_checkout(svf_h);
+	if (svf_h->io_h == svf_h->io_private_h) {
+		svf_h->io_h = hedge->primary_io_h;
+		svf_h->socket_path = hedge->primary_socket_path;
+		return false;
+	}
+
+	hedge->io_h = svf_h->io_h;
+	hedge->io_h->io_error = false;
+	hedge->socket_path = svf_h->socket_path;
+	hedge->slot = svf_backend_slot_get(svf_backend_table_h,
+		hedge->socket_path);
+	svf_backend_begin(hedge->slot);
+	hedge->start_time = timeval_current();
+
+	DEBUG(5,("Hedging slow scan request: %s: Sending to %s\n",
+		hedge->primary_socket_path, hedge->socket_path));
+
+	return true;
+}
+
+/* Cancel the loser by ending its connection, and leave the winner in
+   svf_h->io_h. sent is false if the module gave up the hedge request.
+   If the hedge request won, the scan finishes it on its backend. */
+static void svf_hedge_finish(svf_handle *svf_h, svf_hedge *hedge,
+	bool sent, bool won)
+{
+	bool failed = !won && hedge->io_h->io_error;
+	struct timeval tv_now;
+
+	svf_h->io_h = won ? hedge->primary_io_h : hedge->io_h;
+	svf_h->socket_path = won ? hedge->primary_socket_path :
+		hedge->socket_path;
+#ifdef svf_module_scan_end
+	svf_module_scan_end(svf_h);
+#else
+	svf_io_disconnect(svf_h->io_h);
+#endif
+	svf_io_pool_checkin(svf_h, false);
+
+	if (won) {
+		tv_now = timeval_current();
+		svf_h->hedge_won_slot = hedge->slot;
+		svf_h->hedge_won_usec = usec_time_diff(&tv_now,
+			&hedge->start_time);
+	} else if (failed) {
+		svf_backend_end_log(svf_h, hedge->slot, hedge->socket_path,
+			true);
+	} else {
+		/* Not answered in time: Neither failed nor recovered */
+		svf_backend_cancel(hedge->slot);
+	}
+
+	if (sent) {
+		svf_h->hedge_count++;
+	}
+	if (won) {
+		svf_h->hedge_won_count++;
+		DEBUG(5,("Hedged scan request won: %s\n", hedge->socket_path));
+	}
+
+	svf_h->io_h = won ? hedge->io_h : hedge->primary_io_h;
+	svf_h->socket_path = won ? hedge->socket_path :
+		hedge->primary_socket_path;
+}
+
+/* Adaptive I/O timeout
+ * ---------------------------------------------------------------------- */
+
+static int svf_latency_bucket(off_t size)
+{
+	int bucket = 0;
+
+	/* Factor 16 per bucket from 4KiB */
+	for (size >>= 12; size > 0 && bucket < SVF_LATENCY_BUCKET_NUM - 1;
+	     size >>= 4) {
+		bucket++;
+	}
+
+	return bucket;
+}
+
+static svf_latency_model *svf_latency_model_get(const char *socket_path,
+	bool create)
+{
+	svf_latency_model *model;
+
+	for (model = svf_latency_models; model; model = model->next) {
+		if (str_eq(model->socket_path, socket_path)) {
+			return model;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	/* Outlives the connection: Freed at process exit */
+	model = TALLOC_ZERO_P(NULL, svf_latency_model);
+	if (!model) {
+		return NULL;
+	}
+	model->socket_path = talloc_strdup(model, socket_path);
+	if (!model->socket_path) {
+		TALLOC_FREE(model);
+		return NULL;
+	}
+	DLIST_ADD(svf_latency_models, model);
+
+	return model;
+}
+
+static void svf_latency_add(svf_handle *svf_h, off_t size, int64_t usec)
+{
+	svf_latency_model *model;
+	int bucket;
+
+	if (!svf_h->adaptive_io_timeout) {
+		return;
+	}
+
+	model = svf_latency_model_get(svf_h->socket_path, true);
+	if (!model) {
+		return;
+	}
+
+	bucket = svf_latency_bucket(size);
+	model->buckets[bucket].samples[model->buckets[bucket].sample_count %
+		SVF_LATENCY_SAMPLE_NUM] = usec;
+	model->buckets[bucket].sample_count++;
+}
+
+/* Return the deadline (msec) of a scan of a file of the size: The
+   latency at "adaptive io timeout percentile" times "adaptive io timeout
+   factor", at least "adaptive io timeout min" and at most "io timeout",
+   or 0 if unknown yet */
+static int svf_adaptive_io_timeout(svf_handle *svf_h, off_t size)
+{
+	int64_t sorted[SVF_LATENCY_SAMPLE_NUM];
+	svf_latency_model *model;
+	int bucket;
+	int n;
+	int percentile;
+	int64_t msec;
+
+	if (!svf_h->adaptive_io_timeout) {
+		return 0;
+	}
+
+	model = svf_latency_model_get(svf_h->socket_path, false);
+	if (!model) {
+		return 0;
+	}
+
+	bucket = svf_latency_bucket(size);
+	n = MIN(model->buckets[bucket].sample_count, SVF_LATENCY_SAMPLE_NUM);
+	if (n < SVF_LATENCY_SAMPLE_MIN) {
+		return 0;
+	}
+
+	memcpy(sorted, model->buckets[bucket].samples, n * sizeof(sorted[0]));
+	qsort(sorted, n, sizeof(sorted[0]), svf_hedge_sample_cmp);
+	percentile = MIN(MAX(svf_h->adaptive_io_timeout_percentile, 1), 100);
+	msec = sorted[(n - 1) * percentile / 100] / 1000 *
+		MAX(svf_h->adaptive_io_timeout_factor, 1);
+
+	msec = MAX(msec, svf_h->adaptive_io_timeout_min);
+	if (svf_h->io_timeout > 0) {
+		msec = MIN(msec, svf_h->io_timeout);
+	}
+
+	return (int)msec;
+}
+#endif
+
+static void svf_load_config(svf_handle *svf_h)
+{
+	int snum = SNUM(svf_h->vfs_h->conn);
+	int cache_snum;
+	char *exclude_files;
 
 #ifdef SVF_DEFAULT_SCAN_REQUEST_LIMIT
         svf_h->scan_request_limit = lp_parm_int(
@@ -231,19 +986,49 @@ static int svf_vfs_connect(
 		snum, SVF_MODULE_NAME,
 		"exclude files",
 		SVF_DEFAULT_EXCLUDE_FILES);
+	if (svf_h->exclude_files) {
+		free_namearray(svf_h->exclude_files);
+		svf_h->exclude_files = NULL;
+	}
 	if (exclude_files) {
 		set_namearray(&svf_h->exclude_files, exclude_files);
 		TALLOC_FREE(exclude_files);
 	}
 
+	/* A cache shared by all shares is sized by the global section only */
+	cache_snum = (svf_h->cache_scope == SVF_CACHE_SCOPE_PROCESS) ? -1 : snum;
         svf_h->cache_entry_limit = lp_parm_int(
-		snum, SVF_MODULE_NAME,
+		cache_snum, SVF_MODULE_NAME,
 		"cache entry limit",
 		SVF_DEFAULT_CACHE_ENTRY_LIMIT);
         svf_h->cache_time_limit = lp_parm_int(
-		snum, SVF_MODULE_NAME,
+		cache_snum, SVF_MODULE_NAME,
 		"cache time limit",
 		SVF_DEFAULT_CACHE_TIME_LIMIT);
+        svf_h->cache_size_limit = (size_t)lp_parm_ulong(
+		cache_snum, SVF_MODULE_NAME,
+		"cache size limit",
+		SVF_DEFAULT_CACHE_SIZE_LIMIT);
+        svf_h->cache_clean_time_limit = lp_parm_int(
+		cache_snum, SVF_MODULE_NAME,
+		"cache clean time limit",
+		SVF_DEFAULT_CACHE_CLEAN_TIME_LIMIT);
+        svf_h->cache_infected_time_limit = lp_parm_int(
+		cache_snum, SVF_MODULE_NAME,
+		"cache infected time limit",
+		SVF_DEFAULT_CACHE_INFECTED_TIME_LIMIT);
+        svf_h->cache_error_time_limit = lp_parm_int(
+		cache_snum, SVF_MODULE_NAME,
+		"cache error time limit",
+		SVF_DEFAULT_CACHE_ERROR_TIME_LIMIT);
+        svf_h->cache_content_hash_time_limit = lp_parm_int(
+		cache_snum, SVF_MODULE_NAME,
+		"cache content hash time limit",
+		SVF_DEFAULT_CACHE_CONTENT_HASH_TIME_LIMIT);
+        svf_h->cache_signature_check_interval = lp_parm_int(
+		cache_snum, SVF_MODULE_NAME,
+		"cache signature check interval",
+		SVF_DEFAULT_CACHE_SIGNATURE_CHECK_INTERVAL);
 
         svf_h->infected_file_action = lp_parm_enum(
 		snum, SVF_MODULE_NAME,
@@ -289,43 +1074,384 @@ static int svf_vfs_connect(
 		SVF_DEFAULT_SCAN_ERROR_ERRNO_ON_CLOSE);
 
 #ifdef SVF_DEFAULT_SOCKET_PATH
-        svf_h->socket_path = lp_parm_const_string(
+	/* Whitespace or comma separated list of backends */
+	TALLOC_FREE(svf_h->socket_paths);
+	svf_h->socket_paths = str_list_make_v3(svf_h, lp_parm_const_string(
 		snum, SVF_MODULE_NAME,
 		"socket path",
-		SVF_DEFAULT_SOCKET_PATH);
-        connect_timeout = lp_parm_int(
+		SVF_DEFAULT_SOCKET_PATH), NULL);
+	svf_h->socket_path_num = str_list_length(svf_h->socket_paths);
+	svf_h->socket_path = (svf_h->socket_path_num > 0) ?
+		svf_h->socket_paths[0] : SVF_DEFAULT_SOCKET_PATH;
+        svf_h->backend_error_limit = lp_parm_int(
+		snum, SVF_MODULE_NAME,
+		"backend error limit",
+		SVF_DEFAULT_BACKEND_ERROR_LIMIT);
+        svf_h->backend_retry_interval = lp_parm_int(
+		snum, SVF_MODULE_NAME,
+		"backend retry interval",
+		SVF_DEFAULT_BACKEND_RETRY_INTERVAL);
+        svf_h->hedge_percentile = lp_parm_int(
+		snum, SVF_MODULE_NAME,
+		"hedge percentile",
+		SVF_DEFAULT_HEDGE_PERCENTILE);
+        svf_h->hedge_min_delay = lp_parm_int(
+		snum, SVF_MODULE_NAME,
+		"hedge min delay",
+		SVF_DEFAULT_HEDGE_MIN_DELAY);
+        svf_h->adaptive_io_timeout = lp_parm_bool(
+		snum, SVF_MODULE_NAME,
+		"adaptive io timeout",
+		SVF_DEFAULT_ADAPTIVE_IO_TIMEOUT);
+        svf_h->adaptive_io_timeout_percentile = lp_parm_int(
+		snum, SVF_MODULE_NAME,
+		"adaptive io timeout percentile",
+		SVF_DEFAULT_ADAPTIVE_IO_TIMEOUT_PERCENTILE);
+        svf_h->adaptive_io_timeout_factor = lp_parm_int(
+		snum, SVF_MODULE_NAME,
+		"adaptive io timeout factor",
+		SVF_DEFAULT_ADAPTIVE_IO_TIMEOUT_FACTOR);
+        svf_h->adaptive_io_timeout_min = lp_parm_int(
+		snum, SVF_MODULE_NAME,
+		"adaptive io timeout min",
+		SVF_DEFAULT_ADAPTIVE_IO_TIMEOUT_MIN);
+        svf_h->connect_timeout = lp_parm_int(
 		snum, SVF_MODULE_NAME,
 		"connect timeout",
 		SVF_DEFAULT_CONNECT_TIMEOUT);
-        io_timeout = lp_parm_int(
+        svf_h->io_timeout = lp_parm_int(
 		snum, SVF_MODULE_NAME,
 		"io timeout",
 		SVF_DEFAULT_TIMEOUT);
+        svf_h->ping_interval = lp_parm_int(
+		snum, SVF_MODULE_NAME,
+		"ping interval",
+		SVF_DEFAULT_PING_INTERVAL);
+#endif
+}
+
+static void svf_tdb_cache_compact_schedule(void);
 
-	svf_h->io_h = svf_io_new(svf_h, connect_timeout, io_timeout);
+/* Compact the shared caches between client requests: Traversing them
+   in an open or close would stall the client */
+static void svf_tdb_cache_compact_handler(
+	struct tevent_context *ev,
+	struct tevent_timer *te,
+	struct timeval current_time,
+	void *private_data)
+{
+	svf_tdb_cache_compact_te = NULL;
+
+	if (svf_tdb_cache_h) {
+		svf_tdb_cache_compact_if_due(svf_tdb_cache_h);
+	}
+	if (svf_db_cache_h) {
+		svf_tdb_cache_compact_if_due(svf_db_cache_h);
+	}
+
+	svf_tdb_cache_compact_schedule();
+}
+
+static void svf_tdb_cache_compact_schedule(void)
+{
+	if (svf_tdb_cache_compact_te) {
+		return;
+	}
+
+	svf_tdb_cache_compact_te = event_add_timed(svf_event_context(), NULL,
+		timeval_current_ofs(SVF_TDB_CACHE_COMPACT_CHECK_INTERVAL, 0),
+		svf_tdb_cache_compact_handler, NULL);
+	if (!svf_tdb_cache_compact_te) {
+		DEBUG(0,("event_add_timed failed: "
+			"Persistent cache not compacted\n"));
+	}
+}
+
+static int svf_vfs_connect(
+	vfs_handle_struct *vfs_h,
+	const char *svc,
+	const char *user)
+{
+	int snum = SNUM(vfs_h->conn);
+	int cache_snum;
+	svf_handle *svf_h;
+
+	svf_h = TALLOC_ZERO_P(vfs_h, svf_handle);
+	if (!svf_h) {
+		DEBUG(0, ("TALLOC_ZERO_P failed\n"));
+		return -1;
+	}
+
+	svf_h->vfs_h = vfs_h;
+	DLIST_ADD(svf_handles, svf_h);
+	talloc_set_destructor(svf_h, svf_destruct_config);
+
+	SMB_VFS_HANDLE_SET_DATA(vfs_h,
+		svf_h,
+		NULL,
+		svf_handle,
+		return -1);
+
+        svf_h->cache_scope = lp_parm_enum(
+		snum, SVF_MODULE_NAME,
+		"cache scope", svf_cache_scopes,
+		SVF_DEFAULT_CACHE_SCOPE);
+	svf_load_config(svf_h);
+
+	/* Options below are used only here and not reloaded */
+	cache_snum = (svf_h->cache_scope == SVF_CACHE_SCOPE_PROCESS) ? -1 : snum;
+        svf_h->cache_backend = lp_parm_enum(
+		cache_snum, SVF_MODULE_NAME,
+		"cache backend", svf_cache_backends,
+		SVF_DEFAULT_CACHE_BACKEND);
+        svf_h->cache_content_hash = lp_parm_bool(
+		snum, SVF_MODULE_NAME,
+		"cache content hash",
+		SVF_DEFAULT_CACHE_CONTENT_HASH);
+        svf_h->cache_xattr = lp_parm_bool(
+		snum, SVF_MODULE_NAME,
+		"cache xattr",
+		SVF_DEFAULT_CACHE_XATTR);
+	/* Copied: Strings of the configuration are freed on reload */
+        svf_h->cache_xattr_name = talloc_strdup(svf_h, lp_parm_const_string(
+		snum, SVF_MODULE_NAME,
+		"cache xattr name",
+		SVF_DEFAULT_CACHE_XATTR_NAME));
+	if (!svf_h->cache_xattr_name) {
+		svf_h->cache_xattr = false;
+	}
+	svf_h->cache_flush_token = talloc_strdup(svf_h, lp_parm_const_string(
+		cache_snum, SVF_MODULE_NAME,
+		"cache flush token",
+		NULL));
+
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	svf_h->io_h = svf_h->io_private_h = svf_io_new(svf_h,
+		svf_h->connect_timeout, svf_h->io_timeout);
 	if (!svf_h->io_h) {
 		DEBUG(0,("svf_io_new failed"));
 		return -1;
 	}
-#endif
+        svf_h->io_pool_size = lp_parm_int(
+		-1, SVF_MODULE_NAME,
+		"connection pool size",
+		SVF_DEFAULT_CONNECTION_POOL_SIZE);
+#endif
+
+#ifdef svf_module_connect
+	/* Before the cache keys: The module reads the scan options it has */
+	if (svf_module_connect(vfs_h, svf_h, svc, user) == -1) {
+		return -1;
+	}
+#endif
+
+	if (!svf_cache_options_tag_set(svf_h)) {
+		DEBUG(0,("svf_cache_options_tag_set failed\n"));
+		return -1;
+	}
+
+	if (svf_h->cache_entry_limit >= 0 &&
+	    svf_h->cache_scope == SVF_CACHE_SCOPE_PROCESS) {
+		if (svf_cache_key_prefix_set(svf_h) && !svf_process_cache_h) {
+			/* Outlives the connection: Freed at process exit */
+			svf_process_cache_h = svf_cache_new_by_handle(NULL,
+				svf_h, svf_h->cache_time_limit);
+		}
+		if (svf_h->cache_key_prefix) {
+			svf_h->cache_h = svf_process_cache_h;
+		}
+		if (!svf_h->cache_h) {
+			DEBUG(0,("Initializing cache failed: Cache disabled"));
+		}
+	} else if (svf_h->cache_entry_limit >= 0) {
+		svf_h->cache_h = svf_cache_new_by_handle(vfs_h,
+			svf_h, svf_h->cache_time_limit);
+		if (!svf_h->cache_h) {
+			DEBUG(0,("Initializing cache failed: Cache disabled"));
+		}
+	}
+
+	if (svf_h->cache_h && svf_h->cache_content_hash) {
+		if (svf_h->cache_scope != SVF_CACHE_SCOPE_PROCESS) {
+			svf_h->digest_cache_h = svf_cache_new_by_handle(vfs_h,
+				svf_h, svf_h->cache_content_hash_time_limit);
+		} else {
+			if (!svf_process_digest_cache_h) {
+				svf_process_digest_cache_h =
+					svf_cache_new_by_handle(NULL, svf_h,
+					svf_h->cache_content_hash_time_limit);
+			}
+			svf_h->digest_cache_h = svf_process_digest_cache_h;
+		}
+		if (!svf_h->digest_cache_h) {
+			DEBUG(0,("Initializing content hash cache failed: "
+				"Content hash cache disabled\n"));
+		}
+	}
+
+	if (svf_h->cache_h && svf_h->cache_xattr && !svf_xattr_key_loaded) {
+		/* Shared by all processes (and cluster nodes if the
+		   file is on a shared file system) */
+		const char *key_path = lp_parm_const_string(
+			-1, SVF_MODULE_NAME,
+			"cache xattr key file",
+			SVF_DEFAULT_CACHE_XATTR_KEY_FILE);
+		char *key_path_default = NULL;
+
+		if (!key_path) {
+			key_path = key_path_default =
+				lock_path(SVF_MODULE_NAME ".key");
+		}
+		if (key_path) {
+			become_root();
+			svf_xattr_key_loaded = (svf_xattr_key_load(
+				key_path, svf_xattr_key) == 0);
+			unbecome_root();
+		}
+		TALLOC_FREE(key_path_default);
+	}
+	if (svf_h->cache_xattr && (!svf_h->cache_h || !svf_xattr_key_loaded)) {
+		DEBUG(0,("Loading key for xattr cache failed: "
+			"xattr cache disabled\n"));
+		svf_h->cache_xattr = false;
+	}
+
+	/* Files changed through shares without a cache invalidate, too */
+	if (!svf_cache_inval_h && lp_parm_bool(
+	    -1, SVF_MODULE_NAME,
+	    "cache invalidation",
+	    SVF_DEFAULT_CACHE_INVALIDATION)) {
+		char *inval_path = lock_path(SVF_MODULE_NAME ".inval");
+
+		if (inval_path) {
+			become_root();
+			svf_cache_inval_h = svf_cache_inval_new(NULL, inval_path);
+			unbecome_root();
+			TALLOC_FREE(inval_path);
+		}
+		if (!svf_cache_inval_h) {
+			DEBUG(0,("Initializing cache invalidation failed: "
+				"Cached results are not invalidated by "
+				"other processes\n"));
+		}
+	}
+	if (svf_h->cache_h && svf_cache_inval_h) {
+		svf_cache_set_inval(svf_h->cache_h, svf_cache_inval_h);
+	}
+
+	if (svf_h->cache_h && svf_h->cache_backend == SVF_CACHE_BACKEND_SHM) {
+		if (!svf_shm_cache_h) {
+			/* Shared by all processes: Sized by the global section only */
+			int shm_entry_limit = lp_parm_int(
+				-1, SVF_MODULE_NAME,
+				"cache shm entry limit",
+				SVF_DEFAULT_CACHE_SHM_ENTRY_LIMIT);
+			char *shm_path = lock_path(SVF_MODULE_NAME ".cache");
+
+			if (shm_path) {
+				become_root();
+				svf_shm_cache_h = svf_shm_cache_new(NULL,
+					shm_path, shm_entry_limit);
+				unbecome_root();
+				TALLOC_FREE(shm_path);
+			}
+		}
+		if (svf_shm_cache_h) {
+			svf_cache_set_shm(svf_h->cache_h, svf_shm_cache_h);
+		} else {
+			DEBUG(0,("Initializing shared cache failed: "
+				"Using local cache only\n"));
+		}
+	}
+
+	if (svf_h->cache_h && svf_h->cache_backend == SVF_CACHE_BACKEND_TDB) {
+		if (!svf_tdb_cache_h) {
+			/* Shared by all processes: Bounded by the global section only */
+			off_t tdb_size_limit = (off_t)lp_parm_ulong(
+				-1, SVF_MODULE_NAME,
+				"cache tdb size limit",
+				SVF_DEFAULT_CACHE_TDB_SIZE_LIMIT);
+			char *tdb_path = state_path(SVF_MODULE_NAME ".cache.tdb");
+
+			if (tdb_path) {
+				become_root();
+				svf_tdb_cache_h = svf_tdb_cache_new(NULL,
+					tdb_path, tdb_size_limit);
+				unbecome_root();
+				TALLOC_FREE(tdb_path);
+			}
+		}
+		if (svf_tdb_cache_h) {
+			svf_cache_set_tdb(svf_h->cache_h, svf_tdb_cache_h);
+		} else {
+			DEBUG(0,("Initializing persistent cache failed: "
+				"Using local cache only\n"));
+		}
+	}
 
-	if (svf_h->cache_entry_limit >= 0) {
-		svf_h->cache_h = svf_cache_new(vfs_h,
-			svf_h->cache_entry_limit, svf_h->cache_time_limit);
-		if (!svf_h->cache_h) {
-			DEBUG(0,("Initializing cache failed: Cache disabled"));
+	if (svf_h->cache_h && svf_h->cache_backend == SVF_CACHE_BACKEND_DBWRAP) {
+		if (!svf_db_cache_h) {
+			/* Shared by all nodes: Bounded by the global section only */
+			off_t db_size_limit = (off_t)lp_parm_ulong(
+				-1, SVF_MODULE_NAME,
+				"cache tdb size limit",
+				SVF_DEFAULT_CACHE_TDB_SIZE_LIMIT);
+			/* Distributed by CTDB if clustering = yes */
+			char *db_path = lock_path(SVF_MODULE_NAME ".cache.db.tdb");
+
+			if (db_path) {
+				become_root();
+				svf_db_cache_h = svf_db_cache_new(NULL,
+					db_path, db_size_limit);
+				unbecome_root();
+				TALLOC_FREE(db_path);
+			}
+		}
+		if (svf_db_cache_h) {
+			svf_cache_set_tdb(svf_h->cache_h, svf_db_cache_h);
+		} else {
+			DEBUG(0,("Initializing cluster cache failed: "
+				"Using local cache only\n"));
 		}
 	}
 
-#ifdef svf_module_connect
-	if (svf_module_connect(vfs_h, svf_h, svc, user) == -1) {
-		return -1;
+	if (svf_tdb_cache_h || svf_db_cache_h) {
+		svf_tdb_cache_compact_schedule();
+	}
+
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	if (svf_h->io_pool_size > 0 && !svf_io_pool_key_set(svf_h)) {
+		DEBUG(0,("Initializing connection pool failed: "
+			"Connection not pooled\n"));
 	}
 #endif
 
 	return SMB_VFS_NEXT_CONNECT(vfs_h, svc, user);
 }
 
+static void svf_log_stats(svf_handle *svf_h, int level)
+{
+	DEBUG(level,("Statistics: %s: "
+		"scanned %d files (%lld bytes) in %lld usec; "
+		"hashed %d files (%lld bytes) in %lld usec, %d hits; "
+		"cache %d entries (%lu bytes)\n",
+		lp_servicename(SNUM(svf_h->vfs_h->conn)),
+		svf_h->scan_count, (long long)svf_h->scan_bytes,
+		(long long)svf_h->scan_usec,
+		svf_h->hash_count, (long long)svf_h->hash_bytes,
+		(long long)svf_h->hash_usec, svf_h->hash_hit_count,
+		svf_h->cache_h ? svf_h->cache_h->entry_num : 0,
+		svf_h->cache_h ? (unsigned long)svf_h->cache_h->mem_size : 0UL));
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	if (svf_h->hedge_count > 0) {
+		DEBUG(level,("Statistics: %s: "
+			"hedged %d scans, %d won by the hedge\n",
+			lp_servicename(SNUM(svf_h->vfs_h->conn)),
+			svf_h->hedge_count, svf_h->hedge_won_count));
+	}
+#endif
+}
+
 static void svf_vfs_disconnect(vfs_handle_struct *vfs_h)
 {
 	svf_handle *svf_h;
@@ -338,7 +1464,10 @@ static void svf_vfs_disconnect(vfs_handle_struct *vfs_h)
 				svf_handle,
 				return);
 
+	svf_log_stats(svf_h, 3);
+
 	free_namearray(svf_h->exclude_files);
+	svf_h->exclude_files = NULL;
 #ifdef SVF_DEFAULT_SOCKET_PATH
 	svf_io_disconnect(svf_h->io_h);
 #endif
@@ -598,6 +1727,340 @@ done:
 	TALLOC_FREE(command);
 }
 
+#ifdef svf_module_scan_version
+static void svf_scan_version_check(svf_handle *svf_h)
+{
+	time_t time_now = time(NULL);
+	/* A cache shared by all shares has one version: Check it once */
+	time_t *check_timep = (svf_h->cache_scope == SVF_CACHE_SCOPE_PROCESS) ?
+		&svf_process_version_check_time :
+		&svf_h->scan_version_check_time;
+	char *version;
+
+	if (svf_h->cache_signature_check_interval <= 0 ||
+	    time_now < *check_timep) {
+		return;
+	}
+	*check_timep = time_now + svf_h->cache_signature_check_interval;
+
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	if (!svf_backend_choose_closed(svf_h)) {
+		DEBUG(5,("No scanner backend available: "
+			"Version check skipped\n"));
+		return;
+	}
+	svf_io_pool_checkout(svf_h);
+#endif
+	version = svf_module_scan_version(talloc_tos(), svf_h);
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	svf_io_pool_checkin(svf_h, version == NULL);
+#endif
+	if (!version) {
+		DEBUG(1,("Checking scanner version failed: "
+			"Keeping cached results\n"));
+		return;
+	}
+
+	if (svf_h->cache_flush_token) {
+		/* Results cached with another token are not used either */
+		version = talloc_asprintf_append(version, "\n%s",
+			svf_h->cache_flush_token);
+		if (!version) {
+			DEBUG(0,("talloc_asprintf_append failed\n"));
+			return;
+		}
+	}
+
+	if (svf_cache_set_version(svf_h->cache_h, version)) {
+		DEBUG(3,("Scanner version changed: %s: Cache flushed\n",
+			version));
+	}
+	if (svf_h->digest_cache_h) {
+		svf_cache_set_version(svf_h->digest_cache_h, version);
+	}
+
+	TALLOC_FREE(version);
+}
+#endif
+
+static bool svf_scan_xattr_get(
+	vfs_handle_struct *vfs_h,
+	svf_handle *svf_h,
+	const struct smb_filename *smb_fname)
+{
+	svf_xattr_verdict verdict;
+	ssize_t size;
+
+	uint32_t generation = svf_cache_shared_generation(svf_h->cache_h,
+		svf_h->cache_options_tag);
+
+	/* Without the signature version, the result may be stale forever */
+	if (generation == 0 || !VALID_STAT(smb_fname->st)) {
+		return false;
+	}
+
+	/* trusted.* is readable by root only */
+	become_root();
+	size = SMB_VFS_NEXT_GETXATTR(vfs_h, smb_fname->base_name,
+		svf_h->cache_xattr_name, &verdict, sizeof(verdict));
+	unbecome_root();
+	if (size != sizeof(verdict)) {
+		return false;
+	}
+
+	return svf_xattr_verdict_check(&verdict, svf_xattr_key,
+		SVF_MODULE_ENGINE, generation, &smb_fname->st);
+}
+
+static int svf_scan_xattr_write(
+	vfs_handle_struct *vfs_h,
+	svf_handle *svf_h,
+	const struct smb_filename *smb_fname,
+	const svf_xattr_verdict *verdict)
+{
+	int ret;
+
+	/* The user may only have read access to the file */
+	become_root();
+	ret = SMB_VFS_NEXT_SETXATTR(vfs_h, smb_fname->base_name,
+		svf_h->cache_xattr_name, verdict, sizeof(*verdict), 0);
+	unbecome_root();
+
+	if (ret == -1) {
+		DEBUG(5,("Setting scan result xattr failed: %s/%s: %s\n",
+			vfs_h->conn->connectpath, smb_fname->base_name,
+			strerror(errno)));
+	}
+
+	return ret;
+}
+
+/* Setting the xattr updates ctime: *stp is updated to the stat after it
+   for the other caches validated by ctime */
+static void svf_scan_xattr_set(
+	vfs_handle_struct *vfs_h,
+	svf_handle *svf_h,
+	const struct smb_filename *smb_fname,
+	SMB_STRUCT_STAT *stp)
+{
+	struct smb_filename smb_fname_set = *smb_fname;
+	const SMB_STRUCT_STAT *st = &smb_fname->st;
+	svf_xattr_verdict verdict;
+	uint32_t generation = svf_cache_shared_generation(svf_h->cache_h,
+		svf_h->cache_options_tag);
+	time_t time_now = time(NULL);
+
+	if (generation == 0 || !VALID_STAT(smb_fname->st)) {
+		return;
+	}
+	/* Same as svf_cache_entry_set_validator() */
+	if (smb_fname->st.st_ex_mtime.tv_sec + SVF_CACHE_VALIDATOR_RACY_TIME >= time_now) {
+		return;
+	}
+
+	/* An unsigned placeholder, to stamp the signed verdict with the
+	   ctime it sets by the clock of the file system */
+	ZERO_STRUCT(verdict);
+	if (svf_scan_xattr_write(vfs_h, svf_h, smb_fname, &verdict) == -1 ||
+	    SMB_VFS_NEXT_STAT(vfs_h, &smb_fname_set) == -1) {
+		return;
+	}
+	/* Changed since scanned */
+	if (smb_fname_set.st.st_ex_ino != st->st_ex_ino ||
+	    smb_fname_set.st.st_ex_size != st->st_ex_size ||
+	    smb_fname_set.st.st_ex_mtime.tv_sec != st->st_ex_mtime.tv_sec ||
+	    smb_fname_set.st.st_ex_mtime.tv_nsec != st->st_ex_mtime.tv_nsec) {
+		return;
+	}
+
+	svf_xattr_verdict_set(&verdict, svf_xattr_key,
+		SVF_MODULE_ENGINE, generation, &smb_fname_set.st);
+	if (svf_scan_xattr_write(vfs_h, svf_h, smb_fname, &verdict) == -1) {
+		return;
+	}
+
+	if (SMB_VFS_NEXT_STAT(vfs_h, &smb_fname_set) == 0) {
+		*stp = smb_fname_set.st;
+	}
+}
+
+static void svf_scan_cache_add(
+	svf_cache_handle *cache_h,
+	const char *options,
+	const char *key,
+	int key_len,
+	svf_result scan_result,
+	const char *scan_report,
+	int64_t scan_usec,
+	const SMB_STRUCT_STAT *st,
+	uint32_t inval_seq)
+{
+	svf_cache_entry *scan_cache_e;
+
+	DEBUG(10, ("Adding new cache entry: %s, %d\n", key, scan_result));
+	scan_cache_e = svf_cache_entry_new(cache_h, key, key_len);
+	if (!scan_cache_e) {
+		DEBUG(0,("Cannot create cache entry: svf_cache_entry_new failed"));
+		return;
+	}
+	scan_cache_e->result = scan_result;
+	if (!svf_cache_entry_set_report(scan_cache_e, scan_report)) {
+		DEBUG(0,("Cannot create cache entry: svf_cache_entry_set_report failed"));
+		svf_cache_entry_free(scan_cache_e);
+		return;
+	}
+	if (st) {
+		svf_cache_entry_set_validator(scan_cache_e, st);
+		svf_cache_entry_set_inval_seq(scan_cache_e, st, inval_seq);
+	}
+	svf_cache_entry_set_cost(scan_cache_e, scan_usec);
+
+	svf_cache_add(cache_h, scan_cache_e, options);
+}
+
+/* Scan a file by the scanner. Sets *failedp to true if the scanner
+   could not be initialized or the connection to it failed. */
+static svf_result svf_scan_by_scanner(
+	vfs_handle_struct *vfs_h,
+	svf_handle *svf_h,
+	const struct smb_filename *smb_fname,
+	const char **reportp,
+	int64_t *scan_usecp,
+	bool *failedp)
+{
+	svf_result scan_result;
+	struct timeval tv_start, tv_end;
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	int64_t usec;
+	int deadline;
+
+	svf_h->io_h->io_error = false;
+	svf_h->hedge_won_slot = NULL;
+#endif
+
+#ifdef svf_module_scan_init
+	if (svf_module_scan_init(svf_h) != SVF_RESULT_OK) {
+		if (failedp) {
+			*failedp = true;
+		}
+		*reportp = "Initializing scanner failed";
+		return SVF_RESULT_ERROR;
+	}
+#endif
+
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	deadline = svf_adaptive_io_timeout(svf_h, smb_fname->st.st_ex_size);
+	svf_io_set_deadline(svf_h->io_h, deadline);
+#endif
+
+	tv_start = timeval_current();
+	scan_result = svf_module_scan(vfs_h, svf_h, smb_fname, reportp);
+	tv_end = timeval_current();
+	svf_h->scan_count++;
+	svf_h->scan_bytes += smb_fname->st.st_ex_size;
+	*scan_usecp = usec_time_diff(&tv_end, &tv_start);
+	svf_h->scan_usec += *scan_usecp;
+
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	if (failedp) {
+		*failedp = svf_h->io_h->io_error;
+	}
+	/* The latency of the backend that answered */
+	usec = svf_h->hedge_won_slot ? svf_h->hedge_won_usec : *scan_usecp;
+	if (!svf_h->io_h->io_error) {
+		svf_hedge_sample_add(usec);
+		svf_latency_add(svf_h, smb_fname->st.st_ex_size, usec);
+	} else if (svf_h->io_h->deadline_expired) {
+		DEBUG(1,("Scan timed out in %d msec (adaptive io timeout): "
+			"%s: %s\n", deadline, svf_h->socket_path,
+			smb_fname->base_name));
+	}
+	/* The winner of a hedged request may be another connection */
+	svf_io_set_deadline(svf_h->io_h, 0);
+#endif
+
+#ifdef svf_module_scan_end
+#ifdef SVF_DEFAULT_SCAN_REQUEST_LIMIT
+	/* Counted on the connection, which may be shared by shares */
+	if (svf_h->scan_request_limit > 0) {
+		svf_h->io_h->scan_request_count++;
+		if (svf_h->io_h->scan_request_count >=
+		    svf_h->scan_request_limit) {
+			svf_module_scan_end(svf_h);
+		}
+	}
+#else
+	svf_module_scan_end(svf_h);
+#endif
+#endif
+
+	return scan_result;
+}
+
+#ifdef SVF_DEFAULT_SOCKET_PATH
+/* Scan a file by the backend with the fewest scans in progress, and
+   fail over to another backend once if the scanner failed */
+static svf_result svf_scan_by_backends(
+	vfs_handle_struct *vfs_h,
+	svf_handle *svf_h,
+	const struct smb_filename *smb_fname,
+	const char **reportp,
+	int64_t *scan_usecp)
+{
+	svf_result scan_result = SVF_RESULT_ERROR;
+	svf_backend_slot *slot;
+	int backend = -1;
+	int attempt;
+	bool failed;
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		slot = NULL;
+		if (svf_backend_table_use(svf_h)) {
+			backend = svf_backend_select(svf_backend_table_h,
+				svf_h->socket_paths, svf_h->socket_path_num,
+				backend, svf_h->backend_retry_interval);
+			if (backend == -1) {
+				if (attempt == 0) {
+					/* Fail fast by the error policy */
+					DEBUG(3,("No scanner backend available: "
+						"Circuit breaker open\n"));
+					*reportp = "No scanner backend available";
+				}
+				break;
+			}
+			svf_backend_switch(svf_h, backend);
+			slot = svf_backend_slot_get(svf_backend_table_h,
+				svf_h->socket_path);
+			svf_backend_begin(slot);
+		}
+
+		failed = false;
+		svf_io_pool_checkout(svf_h);
+		scan_result = svf_scan_by_scanner(vfs_h, svf_h, smb_fname,
+			reportp, scan_usecp, &failed);
+		svf_io_pool_checkin(svf_h, failed);
+
+		if (!slot) {
+			break;
+		}
+		if (svf_h->hedge_won_slot) {
+			/* The first backend was slow, and the hedge
+			   request to svf_h->socket_path answered */
+			svf_backend_cancel(slot);
+			slot = svf_h->hedge_won_slot;
+		}
+		svf_backend_end_log(svf_h, slot, svf_h->socket_path, failed);
+		if (!failed) {
+			break;
+		}
+		DEBUG(1,("Scanner backend failed: %s: Trying another one\n",
+			svf_h->socket_path));
+	}
+
+	return scan_result;
+}
+#endif
+
 static svf_result svf_scan(
 	vfs_handle_struct *vfs_h,
 	svf_handle *svf_h,
@@ -606,46 +2069,86 @@ static svf_result svf_scan(
 	svf_result scan_result;
 	const char *scan_report = NULL;
 	char *fname = smb_fname->base_name;
+	const char *cache_key = NULL;
 	svf_cache_entry *scan_cache_e = NULL;
 	bool is_cache = false;
+	bool is_name_cache = false;
+	char digest[SVF_DIGEST_HEX_SIZE];
+	const char *digest_key = NULL;
+	uint32_t inval_seq = 0;
+	bool has_digest = false;
+	struct timeval tv_start, tv_end;
+	int64_t usec;
+	int64_t scan_usec = 0;
 	svf_action file_action;
 	bool add_scan_cache;
+	SMB_STRUCT_STAT cache_st = smb_fname->st;
 
 	if (svf_h->cache_h) {
+#ifdef svf_module_scan_version
+		svf_scan_version_check(svf_h);
+#endif
+		cache_key = svf_cache_key(svf_h->cache_key_prefix, fname);
+	}
+	if (cache_key) {
 		DEBUG(10, ("Searching cache entry: fname: %s\n", fname));
-		scan_cache_e = svf_cache_get(svf_h->cache_h, fname, -1);
+		scan_cache_e = svf_cache_get(svf_h->cache_h, cache_key, -1,
+			&smb_fname->st, svf_h->cache_options_tag);
 		if (scan_cache_e) {
 			DEBUG(10, ("Cache entry found: cached result: %d\n", scan_cache_e->result));
 			is_cache = true;
+			is_name_cache = true;
 			scan_result = scan_cache_e->result;
 			scan_report = scan_cache_e->report;
 			goto svf_scan_result_eval;
 		}
 		DEBUG(10, ("Cache entry not found\n"));
+		/* Changes from now on invalidate the result */
+		inval_seq = svf_cache_inval_seq(svf_h->cache_h, &smb_fname->st);
 	}
 
-#ifdef svf_module_scan_init
-	if (svf_module_scan_init(svf_h) != SVF_RESULT_OK) {
-		scan_result = SVF_RESULT_ERROR;
-		scan_report = "Initializing scanner failed";
+	if (svf_h->cache_xattr && svf_scan_xattr_get(vfs_h, svf_h, smb_fname)) {
+		DEBUG(10, ("Scan result xattr found: %s\n", fname));
+		is_cache = true;
+		scan_result = SVF_RESULT_CLEAN;
+		scan_report = "Clean";
 		goto svf_scan_result_eval;
 	}
-#endif
 
-	scan_result = svf_module_scan(vfs_h, svf_h, smb_fname, &scan_report);
-
-#ifdef svf_module_scan_end
-#ifdef SVF_DEFAULT_SCAN_REQUEST_LIMIT
-	if (svf_h->scan_request_limit > 0) {
-		svf_h->scan_request_count++;
-		if (svf_h->scan_request_count >= svf_h->scan_request_limit) {
-			svf_module_scan_end(svf_h);
-			svf_h->scan_request_count = 0;
+	if (svf_h->digest_cache_h && VALID_STAT(smb_fname->st)) {
+		tv_start = timeval_current();
+		has_digest = (svf_file_digest(fname, &smb_fname->st, digest) == 0);
+		tv_end = timeval_current();
+		usec = usec_time_diff(&tv_end, &tv_start);
+		svf_h->hash_count++;
+		svf_h->hash_bytes += smb_fname->st.st_ex_size;
+		svf_h->hash_usec += usec;
+		DEBUG(10, ("Content hash: %s: %lld usec\n", fname, (long long)usec));
+	}
+	if (has_digest) {
+		digest_key = svf_cache_key(svf_h->cache_digest_key_prefix,
+			digest);
+	}
+	if (digest_key) {
+		scan_cache_e = svf_cache_get(svf_h->digest_cache_h,
+			digest_key, -1, NULL, NULL);
+		if (scan_cache_e) {
+			DEBUG(10, ("Content hash cache entry found: %s: cached result: %d\n",
+				digest, scan_cache_e->result));
+			svf_h->hash_hit_count++;
+			is_cache = true;
+			scan_result = scan_cache_e->result;
+			scan_report = scan_cache_e->report;
+			goto svf_scan_result_eval;
 		}
 	}
+
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	scan_result = svf_scan_by_backends(vfs_h, svf_h, smb_fname,
+		&scan_report, &scan_usec);
 #else
-	svf_module_scan_end(svf_h);
-#endif
+	scan_result = svf_scan_by_scanner(vfs_h, svf_h, smb_fname,
+		&scan_report, &scan_usec, NULL);
 #endif
 
 svf_scan_result_eval:
@@ -686,29 +2189,26 @@ svf_scan_result_eval:
 		break;
 	}
 
-	if (svf_h->cache_h && !is_cache && add_scan_cache) {
-		DEBUG(10, ("Adding new cache entry: %s, %d\n", fname, scan_result));
-		scan_cache_e = svf_cache_entry_new(svf_h->cache_h, fname, -1);
-		if (!scan_cache_e) {
-			DEBUG(0,("Cannot create cache entry: svf_cache_entry_new failed"));
-			goto svf_scan_return;
-		}
-		scan_cache_e->result = scan_result;
-		if (scan_report) {
-			scan_cache_e->report = talloc_strdup(scan_cache_e, scan_report);
-			if (!scan_cache_e->report) {
-				DEBUG(0,("Cannot create cache entry: talloc_strdup failed"));
-				svf_cache_entry_free(scan_cache_e);
-				goto svf_scan_return;
-			}
-		} else {
-			scan_cache_e->report = NULL;
-		}
+	/* Before the other caches: Setting it updates ctime */
+	if (svf_h->cache_xattr && !is_cache && scan_result == SVF_RESULT_CLEAN) {
+		svf_scan_xattr_set(vfs_h, svf_h, smb_fname, &cache_st);
+	}
 
-		svf_cache_add(svf_h->cache_h, scan_cache_e);
+	if (cache_key && !is_name_cache && add_scan_cache) {
+		svf_scan_cache_add(svf_h->cache_h, svf_h->cache_options_tag,
+			cache_key, -1,
+			scan_result, scan_report, scan_usec, &cache_st,
+			inval_seq);
 	}
 
-svf_scan_return:
+	/* Errors are not a property of the content */
+	if (digest_key && !is_cache && add_scan_cache &&
+	    (scan_result == SVF_RESULT_CLEAN ||
+	     scan_result == SVF_RESULT_INFECTED)) {
+		svf_scan_cache_add(svf_h->digest_cache_h, NULL,
+			digest_key, -1,
+			scan_result, scan_report, scan_usec, NULL, 0);
+	}
 
 	return scan_result;
 }
@@ -818,6 +2318,10 @@ static int svf_vfs_close(
 	close_errno = errno;
 	/* FIXME: Return immediately if errno_result == -1, and close_errno == EBADF or ...? */
 
+	if (svf_cache_inval_h && fsp->modified && !fsp->is_directory) {
+		svf_cache_invalidate(svf_cache_inval_h, &fsp->fsp_name->st);
+	}
+
 	if (fsp->is_directory) {
                 DEBUG(5, ("Not scanned: Directory: %s/%s\n",
 			conn->connectpath, fname));
@@ -843,6 +2347,11 @@ static int svf_vfs_close(
 		return close_result;
 	}
 
+	/* The file has been modified: Refresh the stat for the cache validator */
+	if (SMB_VFS_NEXT_STAT(vfs_h, fsp->fsp_name) != 0) {
+		SET_STAT_INVALID(fsp->fsp_name->st);
+	}
+
 	scan_result = svf_scan(vfs_h, svf_h, fsp->fsp_name);
 
 	switch (scan_result) {
@@ -883,6 +2392,7 @@ static int svf_vfs_unlink(
 	int ret = SMB_VFS_NEXT_UNLINK(vfs_h, smb_fname);
 	svf_handle *svf_h;
 	char *fname;
+	const char *cache_key = NULL;
 	svf_cache_entry *scan_cache_e;
 
 	if (ret != 0 && errno != ENOENT) {
@@ -893,10 +2403,17 @@ static int svf_vfs_unlink(
 				svf_handle,
 				return -1);
 
+	if (svf_cache_inval_h) {
+		svf_cache_invalidate(svf_cache_inval_h, &smb_fname->st);
+	}
+
 	if (svf_h->cache_h) {
 		fname = smb_fname->base_name;
+		cache_key = svf_cache_key(svf_h->cache_key_prefix, fname);
+	}
+	if (cache_key) {
 		DEBUG(10, ("Searching cache entry: fname: %s\n", fname));
-		scan_cache_e = svf_cache_get(svf_h->cache_h, fname, -1);
+		scan_cache_e = svf_cache_get(svf_h->cache_h, cache_key, -1, NULL, NULL);
 		if (scan_cache_e) {
 			svf_cache_remove(svf_h->cache_h, scan_cache_e);
 			svf_cache_entry_free(scan_cache_e);
@@ -914,6 +2431,7 @@ static int svf_vfs_rename(
 	int ret = SMB_VFS_NEXT_RENAME(vfs_h, smb_fname_src, smb_fname_dst);
 	svf_handle *svf_h;
 	char *fname;
+	const char *src_key, *dst_key;
 	svf_cache_entry *scan_cache_e;
 
 	if (ret != 0) {
@@ -924,29 +2442,190 @@ static int svf_vfs_rename(
 				svf_handle,
 				return -1);
 
+	if (svf_cache_inval_h) {
+		/* The moved file and the replaced file (if known) */
+		svf_cache_invalidate(svf_cache_inval_h, &smb_fname_src->st);
+		svf_cache_invalidate(svf_cache_inval_h, &smb_fname_dst->st);
+	}
+
 	if (svf_h->cache_h) {
+		src_key = svf_cache_key(svf_h->cache_key_prefix,
+			smb_fname_src->base_name);
+		dst_key = svf_cache_key(svf_h->cache_key_prefix,
+			smb_fname_dst->base_name);
+		if (!src_key || !dst_key) {
+			/* Cannot track the rename: Drop all results */
+			svf_cache_flush(svf_h->cache_h);
+			return ret;
+		}
+
 		fname = smb_fname_dst->base_name;
 		DEBUG(10, ("Searching cache entry: fname: %s\n", fname));
-		scan_cache_e = svf_cache_get(svf_h->cache_h, fname, -1);
+		scan_cache_e = svf_cache_get(svf_h->cache_h, dst_key, -1, NULL, NULL);
 		if (scan_cache_e) {
 			svf_cache_remove(svf_h->cache_h, scan_cache_e);
+			svf_cache_entry_free(scan_cache_e);
 		}
 
 		fname = smb_fname_src->base_name;
 		DEBUG(10, ("Searching cache entry: fname: %s\n", fname));
-		scan_cache_e = svf_cache_get(svf_h->cache_h, fname, -1);
+		scan_cache_e = svf_cache_get(svf_h->cache_h, src_key, -1, NULL, NULL);
 		if (scan_cache_e) {
-			if (!svf_cache_entry_rename(scan_cache_e, smb_fname_dst->base_name, -1)) {
+			if (!svf_cache_entry_rename(svf_h->cache_h, scan_cache_e,
+			    dst_key, -1)) {
+				/* svf_cache_entry_rename() dropped the entry */
 				DEBUG(0,("Cannot rename cache entry: svf_cache_entry_rename failed"));
-				svf_cache_remove(svf_h->cache_h, scan_cache_e);
-				svf_cache_entry_free(scan_cache_e);
 			}
+		} else {
+			/* May be a directory: Files under it have moved */
+			svf_cache_remove_dir(svf_h->cache_h, src_key);
+			svf_cache_remove_dir(svf_h->cache_h, dst_key);
 		}
 	}
 
 	return ret;
 }
 
+static int svf_vfs_rmdir(
+	vfs_handle_struct *vfs_h,
+	const char *path)
+{
+	int ret = SMB_VFS_NEXT_RMDIR(vfs_h, path);
+	svf_handle *svf_h;
+	const char *dname;
+
+	if (ret != 0 && errno != ENOENT) {
+		return ret;
+	}
+
+	SMB_VFS_HANDLE_GET_DATA(vfs_h, svf_h,
+				svf_handle,
+				return -1);
+
+	if (svf_h->cache_h) {
+		dname = svf_cache_key(svf_h->cache_key_prefix, path);
+		if (dname) {
+			svf_cache_remove_dir(svf_h->cache_h, dname);
+		} else {
+			svf_cache_flush(svf_h->cache_h);
+		}
+	}
+
+	return ret;
+}
+
+/* Reloading the configuration
+ * ====================================================================== */
+
+static void svf_reload_config(svf_handle *svf_h)
+{
+	int snum = SNUM(svf_h->vfs_h->conn);
+	int cache_snum;
+	const char *flush_token;
+
+	svf_load_config(svf_h);
+
+	if (!svf_cache_options_tag_set(svf_h)) {
+		DEBUG(0,("Updating cache options failed: Cache flushed\n"));
+		if (svf_h->cache_h) {
+			svf_cache_flush(svf_h->cache_h);
+		}
+	}
+	if (svf_h->cache_h && svf_h->cache_key_prefix &&
+	    !svf_cache_key_prefix_set(svf_h)) {
+		DEBUG(0,("Updating cache keys failed: Cache flushed\n"));
+		svf_cache_flush(svf_h->cache_h);
+	}
+	if (svf_h->cache_h) {
+		svf_cache_set_limits_by_handle(svf_h->cache_h, svf_h,
+			svf_h->cache_time_limit);
+	}
+	if (svf_h->digest_cache_h) {
+		svf_cache_set_limits_by_handle(svf_h->digest_cache_h, svf_h,
+			svf_h->cache_content_hash_time_limit);
+	}
+
+	/* A cache shared by all shares is flushed by the global section only */
+	cache_snum = (svf_h->cache_scope == SVF_CACHE_SCOPE_PROCESS) ? -1 : snum;
+	flush_token = lp_parm_const_string(
+		cache_snum, SVF_MODULE_NAME,
+		"cache flush token",
+		NULL);
+	if ((flush_token == NULL) != (svf_h->cache_flush_token == NULL) ||
+	    (flush_token && strcmp(flush_token, svf_h->cache_flush_token) != 0)) {
+		DEBUG(1,("Cache flush token changed: %s: Cache flushed\n",
+			(cache_snum == -1) ? "global" : lp_servicename(snum)));
+		TALLOC_FREE(svf_h->cache_flush_token);
+		svf_h->cache_flush_token = talloc_strdup(svf_h, flush_token);
+		if (svf_h->cache_h) {
+			svf_cache_flush(svf_h->cache_h);
+		}
+		if (svf_h->digest_cache_h) {
+			svf_cache_flush(svf_h->digest_cache_h);
+		}
+		/* Check now to update the generation of the shared caches */
+		svf_h->scan_version_check_time = 0;
+		if (cache_snum == -1) {
+			svf_process_version_check_time = 0;
+		}
+	}
+
+#ifdef SVF_DEFAULT_SOCKET_PATH
+	svf_io_set_connect_timeout(svf_h->io_h, svf_h->connect_timeout);
+	svf_io_set_io_timeout(svf_h->io_h, svf_h->io_timeout);
+	/* Connect to the (possibly another) scanner on the next scan */
+#ifdef svf_module_scan_end
+	svf_module_scan_end(svf_h);
+#else
+	svf_io_disconnect(svf_h->io_h);
+#endif
+	if (svf_h->io_pool_size > 0 && !svf_io_pool_key_set(svf_h)) {
+		DEBUG(0,("Updating connection pool key failed: "
+			"Connection not pooled\n"));
+		TALLOC_FREE(svf_h->io_pool_key);
+	}
+	svf_io_pool_flush(svf_h);
+#endif
+
+	svf_log_stats(svf_h, 2);
+}
+
+static void svf_reload_handler(
+	struct tevent_context *ev,
+	struct tevent_timer *te,
+	struct timeval current_time,
+	void *private_data)
+{
+	svf_handle *svf_h;
+
+	svf_reload_te = NULL;
+
+	DEBUG(3,("Reloading configuration\n"));
+
+	for (svf_h = svf_handles; svf_h; svf_h = svf_h->next) {
+		svf_reload_config(svf_h);
+	}
+}
+
+static void svf_msg_conf_updated(
+	struct messaging_context *msg_ctx,
+	void *private_data,
+	uint32_t msg_type,
+	struct server_id server_id,
+	DATA_BLOB *data)
+{
+	if (svf_reload_te) {
+		return;
+	}
+
+	/* Run after smbd has reloaded the configuration by its own handler */
+	svf_reload_te = event_add_timed(svf_event_context(), NULL,
+		timeval_zero(), svf_reload_handler, NULL);
+	if (!svf_reload_te) {
+		DEBUG(0,("event_add_timed failed: Configuration not reloaded\n"));
+	}
+}
+
 /* VFS operations */
 static struct vfs_fn_pointers vfs_svf_fns = {
 	.connect_fn =	svf_vfs_connect,
@@ -959,6 +2638,7 @@ static struct vfs_fn_pointers vfs_svf_fns = {
 	.close_fn =	svf_vfs_close,
 	.unlink =	svf_vfs_unlink,
 	.rename =	svf_vfs_rename,
+	.rmdir =	svf_vfs_rmdir,
 };
 
 NTSTATUS init_samba_module(void)
@@ -980,6 +2660,11 @@ NTSTATUS init_samba_module(void)
 			SVF_MODULE_NAME, svf_debug_level));
 	}
 
+	/* "smbcontrol smbd reload-config". Must not override smbd's own
+	   handler registered with NULL private data */
+	messaging_register(svf_messaging_context(), &svf_handles,
+		MSG_SMB_CONF_UPDATED, svf_msg_conf_updated);
+
 	DEBUG(5,("%s registered\n", SVF_MODULE_NAME));
 
 	return ret;
@@ -36,6 +36,7 @@
 #define svf_module_scan_init			svf_sophos_scan_init
 #define svf_module_scan_end			svf_sophos_scan_end
 #define svf_module_scan				svf_sophos_scan
+#define svf_module_scan_version			svf_sophos_scan_version
 
 #include "svf-vfs.h"
 
@@ -83,6 +84,11 @@ static svf_result svf_sophos_scan_init(svf_handle *svf_h)
 	svf_result result;
 
 	if (io_h->socket != -1) {
+		if (svf_io_is_alive(io_h, svf_h->ping_interval)) {
+			DEBUG(10,("SSSP: Re-using recently used connection\n"));
+			return SVF_RESULT_OK;
+		}
+
 		DEBUG(10,("SSSP: Checking if connection is alive\n"));
 
 		if (svf_sophos_scan_ping(svf_h) == SVF_RESULT_OK) {
@@ -170,6 +176,64 @@ static void svf_sophos_scan_end(svf_handle *svf_h)
 	svf_io_disconnect(io_h);
 }
 
+static char *svf_sophos_scan_version(TALLOC_CTX *mem_ctx, svf_handle *svf_h)
+{
+	svf_io_handle *io_h = svf_h->io_h;
+	char *version = NULL;
+
+	if (svf_sophos_scan_init(svf_h) != SVF_RESULT_OK) {
+		return NULL;
+	}
+
+	if (svf_io_writel(io_h, "SSSP/1.0 QUERY SAVI\n", 20) != SVF_RESULT_OK) {
+		DEBUG(0,("SSSP: QUERY: I/O error: %s\n", strerror(errno)));
+		goto svf_sophos_scan_version_failed;
+	}
+	if (svf_io_readl(io_h) != SVF_RESULT_OK) {
+		DEBUG(0,("SSSP: QUERY: Read error: %s\n", strerror(errno)));
+		goto svf_sophos_scan_version_failed;
+	}
+	if (!strn_eq(io_h->r_buffer, "ACC ", 4)) {
+		DEBUG(0,("SSSP: QUERY: Not accepted: %s\n", io_h->r_buffer));
+		goto svf_sophos_scan_version_failed;
+	}
+
+	/* <NAME>: <VALUE> lines (versions and checksums of SAVI, engine
+	   and virus data), "DONE ..." and an empty line */
+	version = talloc_strdup(mem_ctx, "");
+	for (;;) {
+		if (svf_io_readl(io_h) != SVF_RESULT_OK) {
+			DEBUG(0,("SSSP: QUERY: Read error: %s\n", strerror(errno)));
+			goto svf_sophos_scan_version_failed;
+		}
+		if (str_eq(io_h->r_buffer, "")) {
+			break;
+		}
+		if (strn_eq(io_h->r_buffer, "DONE ", 5)) {
+			if (!strn_eq(io_h->r_buffer, "DONE OK ", 8)) {
+				DEBUG(0,("SSSP: QUERY failed: %s\n", io_h->r_buffer));
+				TALLOC_FREE(version);
+			}
+			continue;
+		}
+		if (version) {
+			version = talloc_asprintf_append(version, "%s\n", io_h->r_buffer);
+		}
+	}
+
+	if (version) {
+		DEBUG(7,("SSSP: Version: %s\n", version));
+	}
+
+	return version;
+
+svf_sophos_scan_version_failed:
+	TALLOC_FREE(version);
+	svf_sophos_scan_end(svf_h);
+
+	return NULL;
+}
+
 static svf_result svf_sophos_scan(
 	vfs_handle_struct *vfs_h,
 	svf_handle *svf_h,
@@ -184,6 +248,7 @@ static svf_result svf_sophos_scan(
 	svf_result result = SVF_RESULT_ERROR;
 	const char *report = NULL;
 	char *reply_token, *reply_saveptr;
+	bool retry = true;
 
 	DEBUG(7,("Scanning file: %s/%s\n", connectpath, fname));
 
@@ -209,16 +274,26 @@ static svf_result svf_sophos_scan(
 	}
 	fileurl_len += fileurl_len2;
 
+svf_sophos_scan_send:
 	if (svf_io_writevl(io_h,
 	    "SSSP/1.0 SCANFILE ", 18,
 	    fileurl, fileurl_len,
 	    NULL
 	    ) != SVF_RESULT_OK) {
+		if (retry && io_h->peer_closed) {
+			goto svf_sophos_scan_reconnect;
+		}
 		DEBUG(0,("SSSP: SCANFILE: Write error: %s\n", strerror(errno)));
 		goto svf_sophos_scan_io_error;
 	}
 
-	if (svf_io_readl(io_h) != SVF_RESULT_OK) {
+	if (svf_io_readl(io_h) != SVF_RESULT_OK || io_h->peer_closed) {
+		if (retry && io_h->peer_closed) {
+			goto svf_sophos_scan_reconnect;
+		}
+		if (io_h->peer_closed) { /* EOF */
+			errno = ECONNRESET;
+		}
 		DEBUG(0,("SSSP: SCANFILE: Read error: %s\n", strerror(errno)));
 		goto svf_sophos_scan_io_error;
 	}
@@ -273,6 +348,16 @@ svf_sophos_scan_return:
 
 	return result;
 
+svf_sophos_scan_reconnect:
+	/* Closed by SAVDI while idle: Nothing was scanned, so send again */
+	DEBUG(3,("SSSP: SCANFILE: Connection closed by scanner: Retrying\n"));
+	retry = false;
+	svf_sophos_scan_end(svf_h);
+	if (svf_sophos_scan_init(svf_h) != SVF_RESULT_OK) {
+		goto svf_sophos_scan_io_error;
+	}
+	goto svf_sophos_scan_send;
+
 svf_sophos_scan_io_error:
 	*reportp = talloc_asprintf(talloc_tos(),
 		"Scanner I/O error: %s\n", strerror(errno));
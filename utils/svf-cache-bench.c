@@ -0,0 +1,151 @@
+/*
+   Samba-VirusFilter VFS modules
+   Copyright (C) 2010-2012 SATOH Fumiyasu @ OSS Technology Corp., Japan
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Benchmark of the scan result cache (svf_cache_add() and
+   svf_cache_get()) by the number of entries.
+
+   svf-utils.o links only into smbd, so this is a VFS module that runs
+   the benchmark when a share is connected, and logs the results at
+   debug level 0. Not installed: See "make bench" in test/Makefile.
+
+   [bench]
+   vfs objects = /path/to/svf-cache-bench.so
+   svf-cache-bench:entries = 100 1000 10000 100000 1000000
+*/
+
+#define SVF_MODULE_NAME "svf-cache-bench"
+
+#include "svf-common.h"
+#include "svf-utils.h"
+
+#define SVF_CACHE_BENCH_DEFAULT_ENTRIES	"100 1000 10000 100000 1000000"
+#define SVF_CACHE_BENCH_FILES_PER_DIR	1000
+
+int svf_debug_level = DBGC_VFS;
+
+static int svf_cache_bench_fname(char *buf, size_t size, int n)
+{
+	return snprintf(buf, size, "bench/d%06d/f%09d.txt",
+		n / SVF_CACHE_BENCH_FILES_PER_DIR, n);
+}
+
+static bool svf_cache_bench_run(int entry_num)
+{
+	TALLOC_CTX *mem_ctx = talloc_stackframe();
+	svf_cache_handle *cache_h;
+	svf_cache_entry *cache_e;
+	struct timeval tv_start, tv_end;
+	int64_t add_usec, hit_usec, miss_usec;
+	char fname[PATH_MAX];
+	int fname_len;
+	int hit_num = 0;
+	int i;
+
+	cache_h = svf_cache_new(mem_ctx, entry_num, 3600);
+	if (!cache_h) {
+		TALLOC_FREE(mem_ctx);
+		return false;
+	}
+
+	tv_start = timeval_current();
+	for (i = 0; i < entry_num; i++) {
+		fname_len = svf_cache_bench_fname(fname, sizeof(fname), i);
+		cache_e = svf_cache_entry_new(cache_h, fname, fname_len);
+		if (!cache_e) {
+			TALLOC_FREE(mem_ctx);
+			return false;
+		}
+		cache_e->result = SVF_RESULT_CLEAN;
+		svf_cache_add(cache_h, cache_e, NULL);
+	}
+	tv_end = timeval_current();
+	add_usec = usec_time_diff(&tv_end, &tv_start);
+
+	/* Look up in another order than the insertion one */
+	tv_start = timeval_current();
+	for (i = 0; i < entry_num; i++) {
+		int n = (int)(((uint64_t)i * 2654435761U) % entry_num);
+
+		fname_len = svf_cache_bench_fname(fname, sizeof(fname), n);
+		if (svf_cache_get(cache_h, fname, fname_len, NULL, NULL)) {
+			hit_num++;
+		}
+	}
+	tv_end = timeval_current();
+	hit_usec = usec_time_diff(&tv_end, &tv_start);
+
+	tv_start = timeval_current();
+	for (i = 0; i < entry_num; i++) {
+		fname_len = svf_cache_bench_fname(fname, sizeof(fname),
+			entry_num + i);
+		svf_cache_get(cache_h, fname, fname_len, NULL, NULL);
+	}
+	tv_end = timeval_current();
+	miss_usec = usec_time_diff(&tv_end, &tv_start);
+
+	DEBUG(0,("svf-cache-bench: entries=%d hits=%d "
+		"add=%.3f get(hit)=%.3f get(miss)=%.3f usec/op\n",
+		entry_num, hit_num,
+		(double)add_usec / entry_num,
+		(double)hit_usec / entry_num,
+		(double)miss_usec / entry_num));
+
+	TALLOC_FREE(mem_ctx);
+	return (hit_num == entry_num);
+}
+
+static int svf_cache_bench_connect(
+	vfs_handle_struct *vfs_h,
+	const char *svc,
+	const char *user)
+{
+	int snum = SNUM(vfs_h->conn);
+	const char **entries;
+	int i;
+
+	entries = lp_parm_string_list(snum, SVF_MODULE_NAME, "entries",
+		NULL);
+	if (!entries) {
+		entries = str_list_make_v3(talloc_tos(),
+			SVF_CACHE_BENCH_DEFAULT_ENTRIES, NULL);
+	}
+
+	for (i = 0; entries && entries[i]; i++) {
+		int entry_num = atoi(entries[i]);
+
+		if (entry_num <= 0) {
+			continue;
+		}
+		if (!svf_cache_bench_run(entry_num)) {
+			DEBUG(0,("svf-cache-bench: entries=%d: Failed\n",
+				entry_num));
+		}
+	}
+
+	return SMB_VFS_NEXT_CONNECT(vfs_h, svc, user);
+}
+
+static struct vfs_fn_pointers vfs_svf_cache_bench_fns = {
+	.connect_fn =	svf_cache_bench_connect,
+};
+
+NTSTATUS init_samba_module(void)
+{
+	return smb_register_vfs(SMB_VFS_INTERFACE_VERSION,
+		SVF_MODULE_NAME, &vfs_svf_cache_bench_fns);
+}
@@ -20,6 +20,10 @@
 #include "svf-utils.h"
 
 #include <poll.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 
 #define SVF_ENV_SIZE_CHUNK 32
 
@@ -280,6 +284,42 @@ int svf_io_set_io_timeout(svf_io_handle *io_h, int timeout)
 	return timeout_old;
 }
 
+/* Limit the time of the following requests to msec in total, in addition
+   to the io timeout of each poll. 0 clears the deadline. */
+void svf_io_set_deadline(svf_io_handle *io_h, int msec)
+{
+	io_h->deadline_expired = false;
+	if (msec <= 0) {
+		io_h->has_deadline = false;
+		return;
+	}
+
+	io_h->deadline = timeval_current_ofs_msec(msec);
+	io_h->has_deadline = true;
+}
+
+static int svf_io_poll_timeout(svf_io_handle *io_h)
+{
+	struct timeval now;
+	int64_t remaining;
+
+	if (!io_h->has_deadline) {
+		return io_h->io_timeout;
+	}
+
+	now = timeval_current();
+	remaining = usec_time_diff(&io_h->deadline, &now) / 1000;
+	if (remaining <= 0) {
+		io_h->deadline_expired = true;
+		return 0;
+	}
+	if (io_h->io_timeout > 0 && remaining > io_h->io_timeout) {
+		return io_h->io_timeout;
+	}
+
+	return (int)remaining;
+}
+
 void svf_io_set_writel_eol(svf_io_handle *io_h, const char *eol, int eol_size)
 {
 	if (eol_size < 1 || eol_size > SVF_IO_EOL_SIZE) {
@@ -300,11 +340,143 @@ void svf_io_set_readl_eol(svf_io_handle *io_h, const char *eol, int eol_size)
 	io_h->r_eol_size = eol_size;
 }
 
+/* Remember a transport error until the next connection */
+static svf_result svf_io_error(svf_io_handle *io_h)
+{
+	io_h->io_error = true;
+	if (errno == EPIPE || errno == ECONNRESET) {
+		io_h->peer_closed = true;
+	}
+
+	return SVF_RESULT_ERROR;
+}
+
+bool svf_io_path_is_tcp(const char *path)
+{
+	return strn_eq(path, SVF_IO_TCP_URL_PREFIX,
+		sizeof(SVF_IO_TCP_URL_PREFIX) - 1);
+}
+
+/* tcp://<HOST>:<PORT> or tcp://[<IPV6 ADDRESS>]:<PORT>
+   NOTE: The host name is resolved by a blocking getaddrinfo(3) that is
+   not bounded by "connect timeout". Use an IP address to not depend on
+   the resolver */
+static svf_result svf_io_connect_tcp(svf_io_handle *io_h, const char *url)
+{
+	char *buf;
+	char *host;
+	char *port_str;
+	char *end;
+	long port;
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	struct addrinfo *ai;
+	struct sockaddr_storage ss;
+	NTSTATUS status = NT_STATUS_UNSUCCESSFUL;
+	int ret;
+	int on = 1;
+
+	buf = talloc_strdup(talloc_tos(),
+		url + sizeof(SVF_IO_TCP_URL_PREFIX) - 1);
+	if (!buf) {
+		errno = ENOMEM;
+		return svf_io_error(io_h);
+	}
+
+	host = buf;
+	if (host[0] == '[') {
+		host++;
+		port_str = strchr(host, ']');
+		if (port_str) {
+			*port_str++ = '\0';
+			if (*port_str != ':') {
+				port_str = NULL;
+			}
+		}
+	} else {
+		port_str = strrchr(host, ':');
+	}
+	if (!port_str || host[0] == '\0') {
+		DEBUG(0,("Invalid TCP socket URL: %s\n", url));
+		errno = EINVAL;
+		goto error;
+	}
+	*port_str++ = '\0';
+	port = strtol(port_str, &end, 10);
+	if (end == port_str || *end != '\0' || port <= 0 || port > 65535) {
+		DEBUG(0,("Invalid port number in TCP socket URL: %s\n", url));
+		errno = EINVAL;
+		goto error;
+	}
+
+	ZERO_STRUCT(hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, NULL, &hints, &res);
+	if (ret != 0) {
+		DEBUG(0,("Resolving scanner host failed: %s: %s\n",
+			host, gai_strerror(ret)));
+		errno = EHOSTUNREACH;
+		goto error;
+	}
+
+	/* Try each address of the host within "connect timeout" */
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(ss)) {
+			continue;
+		}
+		ZERO_STRUCT(ss);
+		memcpy(&ss, ai->ai_addr, ai->ai_addrlen);
+		status = open_socket_out(&ss, (uint16_t)port,
+			io_h->connect_timeout,
+			&io_h->socket);
+		if (NT_STATUS_IS_OK(status)) {
+			break;
+		}
+	}
+	freeaddrinfo(res);
+	TALLOC_FREE(buf);
+
+	if (!NT_STATUS_IS_OK(status)) {
+		io_h->socket = -1;
+		errno = map_errno_from_nt_status(status);
+		return svf_io_error(io_h);
+	}
+
+	/* Requests are small lines waiting for a reply: Do not delay them */
+	if (setsockopt(io_h->socket, IPPROTO_TCP, TCP_NODELAY,
+	    &on, sizeof(on)) == -1) {
+		DEBUG(1,("setsockopt(TCP_NODELAY) failed: %s\n",
+			strerror(errno)));
+	}
+	/* Detect a dead scanner host on an idle pooled connection */
+	if (setsockopt(io_h->socket, SOL_SOCKET, SO_KEEPALIVE,
+	    &on, sizeof(on)) == -1) {
+		DEBUG(1,("setsockopt(SO_KEEPALIVE) failed: %s\n",
+			strerror(errno)));
+	}
+
+	return SVF_RESULT_OK;
+
+error:
+	TALLOC_FREE(buf);
+	return svf_io_error(io_h);
+}
+
 svf_result svf_io_connect_path(svf_io_handle *io_h, const char *path)
 {
 	struct sockaddr_un addr;
 	NTSTATUS status;
 
+	io_h->io_error = false;
+	io_h->peer_closed = false;
+	io_h->last_io_time = 0;
+	io_h->scan_request_count = 0;
+
+	if (svf_io_path_is_tcp(path)) {
+		return svf_io_connect_tcp(io_h, path);
+	}
+
 	ZERO_STRUCT(addr);
 	addr.sun_family = AF_UNIX;
 	strncpy(addr.sun_path, path, sizeof(addr.sun_path));
@@ -314,7 +486,7 @@ svf_result svf_io_connect_path(svf_io_handle *io_h, const char *path)
 		&io_h->socket);
 	if (!NT_STATUS_IS_OK(status)) {
 		io_h->socket = -1;
-		return SVF_RESULT_ERROR;
+		return svf_io_error(io_h);
 	}
 
 	return SVF_RESULT_OK;
@@ -329,10 +501,44 @@ svf_result svf_io_disconnect(svf_io_handle *io_h)
 
 	io_h->r_size = io_h->r_rest_size = 0;
 	io_h->r_rest_buffer = NULL;
+	svf_io_request_reset(io_h);
 
 	return SVF_RESULT_OK;
 }
 
+/* Check if a connection can be reused without a round trip: It received
+   data within the last idle_time seconds, and the peer has not closed it
+   since. An idle connection has nothing to read, so readable means EOF,
+   a reset or unexpected data. */
+bool svf_io_is_alive(svf_io_handle *io_h, int idle_time)
+{
+	struct pollfd pollfd;
+
+	if (io_h->socket == -1 || io_h->io_error || io_h->r_rest_buffer) {
+		return false;
+	}
+	if (idle_time <= 0 || io_h->last_io_time == 0 ||
+	    time(NULL) - io_h->last_io_time >= idle_time) {
+		return false;
+	}
+
+	pollfd.fd = io_h->socket;
+	pollfd.events = POLLIN;
+#ifdef POLLRDHUP
+	pollfd.events |= POLLRDHUP;
+#endif
+	pollfd.revents = 0;
+
+	while (poll(&pollfd, 1, 0) == -1) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+
+	/* POLLHUP and POLLERR are reported even if not requested */
+	return (pollfd.revents == 0);
+}
+
 svf_result svf_io_write(svf_io_handle *io_h, const char *data, size_t data_size)
 {
 	struct pollfd pollfd;
@@ -346,16 +552,16 @@ svf_result svf_io_write(svf_io_handle *io_h, const char *data, size_t data_size)
 	pollfd.events = POLLOUT;
 
 	while (data_size > 0) {
-		switch (poll(&pollfd, 1, io_h->io_timeout)) {
+		switch (poll(&pollfd, 1, svf_io_poll_timeout(io_h))) {
 		case -1:
 			if (errno == EINTR) {
 				errno = 0;
 				continue;
 			}
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		case 0:
 			errno = ETIMEDOUT;
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		}
 
 		wrote_size = write(io_h->socket, data, data_size);
@@ -364,7 +570,7 @@ svf_result svf_io_write(svf_io_handle *io_h, const char *data, size_t data_size)
 				errno = 0;
 				continue;
 			}
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		}
 
 		data += wrote_size;
@@ -441,16 +647,16 @@ svf_result svf_io_writev(svf_io_handle *io_h, ...)
 	pollfd.events = POLLOUT;
 
 	for (iov_p = iov;;) {
-		switch (poll(&pollfd, 1, io_h->io_timeout)) {
+		switch (poll(&pollfd, 1, svf_io_poll_timeout(io_h))) {
 		case -1:
 			if (errno == EINTR) {
 				errno = 0;
 				continue;
 			}
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		case 0:
 			errno = ETIMEDOUT;
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		}
 
 		wrote_size = writev(io_h->socket, iov_p, iov_n);
@@ -459,7 +665,7 @@ svf_result svf_io_writev(svf_io_handle *io_h, ...)
 				errno = 0;
 				continue;
 			}
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		}
 
 		data_size -= wrote_size;
@@ -515,16 +721,16 @@ svf_result svf_io_writevl(svf_io_handle *io_h, ...)
 	pollfd.events = POLLOUT;
 
 	for (iov_p = iov;;) {
-		switch (poll(&pollfd, 1, io_h->io_timeout)) {
+		switch (poll(&pollfd, 1, svf_io_poll_timeout(io_h))) {
 		case -1:
 			if (errno == EINTR) {
 				errno = 0;
 				continue;
 			}
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		case 0:
 			errno = ETIMEDOUT;
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		}
 
 		wrote_size = writev(io_h->socket, iov_p, iov_n);
@@ -533,7 +739,7 @@ svf_result svf_io_writevl(svf_io_handle *io_h, ...)
 				errno = 0;
 				continue;
 			}
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		}
 
 		data_size -= wrote_size;
@@ -570,6 +776,7 @@ svf_result svf_io_readl(svf_io_handle *io_h)
 		DEBUG(11,("Rest data not found in read buffer\n"));
 		buffer = io_h->r_buffer = io_h->r_buffer_real;
 		buffer_size = SVF_IO_BUFFER_SIZE;
+		io_h->r_size = 0;
 	} else {
 		DEBUG(11,("Rest data found in read buffer: %s, size=%ld\n",
 			io_h->r_rest_buffer, (long)io_h->r_rest_size));
@@ -589,6 +796,7 @@ svf_result svf_io_readl(svf_io_handle *io_h)
 
 		io_h->r_buffer = io_h->r_buffer_real;
 		memmove(io_h->r_buffer, io_h->r_rest_buffer, io_h->r_rest_size);
+		io_h->r_size = io_h->r_rest_size;
 
 		buffer = io_h->r_buffer + io_h->r_size;
 		buffer_size = SVF_IO_BUFFER_SIZE - io_h->r_rest_size;
@@ -601,16 +809,16 @@ svf_result svf_io_readl(svf_io_handle *io_h)
 	pollfd.events = POLLIN;
 
 	while (buffer_size > 0) {
-		switch (poll(&pollfd, 1, io_h->io_timeout)) {
+		switch (poll(&pollfd, 1, svf_io_poll_timeout(io_h))) {
 		case -1:
 			if (errno == EINTR) {
 				errno = 0;
 				continue;
 			}
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		case 0:
 			errno = ETIMEDOUT;
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		}
 
 		read_size = read(io_h->socket, buffer, buffer_size);
@@ -619,23 +827,28 @@ svf_result svf_io_readl(svf_io_handle *io_h)
 				errno = 0;
 				continue;
 			}
-			return SVF_RESULT_ERROR;
+			return svf_io_error(io_h);
 		}
 
 		buffer[read_size] = '\0';
 
 		if (read_size == 0) { /* EOF */
+			io_h->r_size = 0;
+			io_h->io_error = true;
+			io_h->peer_closed = true;
 			return SVF_RESULT_OK;
 		}
 
 		io_h->r_size += read_size;
+		io_h->last_io_time = time(NULL);
 
-		eol = memmem(io_h->r_buffer, read_size, io_h->r_eol, io_h->r_eol_size);
+		/* Search from the start: A line may span several reads */
+		eol = memmem(io_h->r_buffer, io_h->r_size, io_h->r_eol, io_h->r_eol_size);
 		if (eol) {
 			*eol = '\0';
 			DEBUG(11,("Read line data from socket: %s\n", io_h->r_buffer));
+			io_h->r_rest_size = io_h->r_size - (eol - io_h->r_buffer + io_h->r_eol_size);
 			io_h->r_size = eol - io_h->r_buffer;
-			io_h->r_rest_size = read_size - (eol - buffer + io_h->r_eol_size);
 			if (io_h->r_rest_size > 0) {
 				io_h->r_rest_buffer = eol + io_h->r_eol_size;
 				DEBUG(11,("Rest data in read buffer: %s, size=%ld\n",
@@ -650,7 +863,7 @@ svf_result svf_io_readl(svf_io_handle *io_h)
 
 	errno = E2BIG;
 
-	return SVF_RESULT_ERROR;
+	return svf_io_error(io_h);
 }
 
 svf_result svf_io_writefl_readl(svf_io_handle *io_h, const char *fmt, ...)
@@ -678,132 +891,2373 @@ svf_result svf_io_writefl_readl(svf_io_handle *io_h, const char *fmt, ...)
 	return SVF_RESULT_OK;
 }
 
-/* Generic "stupid" cache
- * ====================================================================== */
+/* Wait until one of the connections has data to read, and return its
+   index, or -1 with errno set (ETIMEDOUT) */
+int svf_io_poll_readable(svf_io_handle **io_hs, int io_h_num, int timeout)
+{
+	struct pollfd pollfds[SVF_IO_POLL_MAX];
+	int i;
 
-svf_cache_handle *svf_cache_new(TALLOC_CTX *ctx, int entry_limit, time_t time_limit)
+	if (io_h_num > SVF_IO_POLL_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < io_h_num; i++) {
+		if (io_hs[i]->r_rest_buffer) {
+			return i;
+		}
+		pollfds[i].fd = io_hs[i]->socket;
+		pollfds[i].events = POLLIN;
+		pollfds[i].revents = 0;
+	}
+
+	for (;;) {
+		switch (poll(pollfds, io_h_num, timeout)) {
+		case -1:
+			if (errno == EINTR) {
+				errno = 0;
+				continue;
+			}
+			return -1;
+		case 0:
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		break;
+	}
+
+	for (i = 0; i < io_h_num; i++) {
+		if (pollfds[i].revents != 0) {
+			return i;
+		}
+	}
+
+	errno = EIO;
+	return -1;
+}
+
+/* Numbered requests
+ * ---------------------------------------------------------------------- */
+
+/* Forget the last request: The IDs restart on a new connection */
+void svf_io_request_reset(svf_io_handle *io_h)
 {
-	svf_cache_handle *cache_h = TALLOC_ZERO_P(ctx, svf_cache_handle);
-	if (!cache_h) {
-		DEBUG(0,("TALLOC_ZERO_P failed\n"));
-		return NULL;
+	io_h->request_id = 0;
+	io_h->reply = NULL;
+}
+
+/* Send a request and return its ID (0 on error). Wait for its reply by
+   svf_io_request_recv() before sending another one */
+uint32_t svf_io_request_vsend(svf_io_handle *io_h, const char *fmt, va_list ap)
+{
+	if (svf_io_vwritefl(io_h, fmt, ap) != SVF_RESULT_OK) {
+		return 0;
 	}
-	cache_h->entry_limit = entry_limit;
-	cache_h->time_limit = time_limit;
 
-	return cache_h;
+	io_h->request_id++;
+	if (io_h->request_id == 0) {
+		io_h->request_id = 1;
+	}
+
+	return io_h->request_id;
 }
 
-svf_cache_entry *svf_cache_entry_new(
-	svf_cache_handle *cache_h,
-	const char *fname,
-	int fname_len)
+/* Wait for the reply to request ID and set io_h->reply to it */
+svf_result svf_io_request_recv(svf_io_handle *io_h, uint32_t id)
 {
-	svf_cache_entry *cache_e = TALLOC_ZERO_P(cache_h, svf_cache_entry);
+	char *line;
+	unsigned long reply_id;
 
-	if (!cache_e) {
-		return NULL;
+	io_h->reply = NULL;
+
+	if (svf_io_readl(io_h) != SVF_RESULT_OK) {
+		return svf_io_error(io_h);
+	}
+	if (io_h->r_size == 0) { /* EOF */
+		errno = ECONNRESET;
+		return svf_io_error(io_h);
 	}
 
-	cache_e->fname = talloc_strdup(cache_e, fname);
-	if (!cache_e->fname) {
-		TALLOC_FREE(cache_e);
-		return NULL;
+	/* <ID>: <REPLY> */
+	errno = 0;
+	reply_id = strtoul(io_h->r_buffer, &line, 10);
+	if (line == io_h->r_buffer || errno != 0 ||
+	    !strn_eq(line, ": ", 2)) {
+		DEBUG(0,("Invalid numbered reply: %s\n", io_h->r_buffer));
+		errno = EPROTO;
+		return svf_io_error(io_h);
+	}
+	if (reply_id != id) {
+		DEBUG(0,("Reply to another request than %lu: %s\n",
+			(unsigned long)id, io_h->r_buffer));
+		errno = EPROTO;
+		return svf_io_error(io_h);
 	}
 
-	cache_e->fname_len = (fname_len >= 0) ? fname_len : strlen(fname);
+	io_h->reply = line + 2;
 
-	return cache_e;
+	return SVF_RESULT_OK;
 }
 
-svf_cache_entry *svf_cache_entry_rename(
-	svf_cache_entry *cache_e,
-	const char *fname,
-	int fname_len)
+/* Shared memory
+ * ====================================================================== */
+
+static int svf_shm_destructor(svf_shm_handle *shm_h)
 {
-	TALLOC_FREE(cache_e->fname);
-	cache_e->fname_len = -1;
+	if (shm_h->map != MAP_FAILED) {
+		munmap(shm_h->map, shm_h->map_size);
+	}
 
-	cache_e->fname = talloc_strdup(cache_e, fname);
-	if (!cache_e->fname) {
-		TALLOC_FREE(cache_e);
+	return 0;
+}
+
+/*
+ * Map a file shared by all smbd processes. An existing valid file is
+ * used as is, even if its size differs from data_size, because other
+ * processes may still map it. Callers must check shm_h->data_size.
+ * The caller must be root if the file is not accessible by the user.
+ */
+svf_shm_handle *svf_shm_new(
+	TALLOC_CTX *mem_ctx,
+	const char *path,
+	uint32_t magic,
+	size_t data_size)
+{
+	svf_shm_handle *shm_h;
+	svf_shm_header header;
+	struct stat st;
+	int fd = -1;
+	int retry;
+
+	shm_h = TALLOC_ZERO_P(mem_ctx, svf_shm_handle);
+	if (!shm_h) {
+		DEBUG(0,("TALLOC_ZERO_P failed\n"));
 		return NULL;
 	}
+	shm_h->map = MAP_FAILED;
+	talloc_set_destructor(shm_h, svf_shm_destructor);
+
+	for (retry = 0; retry < 2; retry++) {
+		fd = open(path, O_RDWR|O_CREAT, 0600);
+		if (fd == -1) {
+			DEBUG(0,("Opening shared memory file failed: %s: %s\n",
+				path, strerror(errno)));
+			goto svf_shm_new_failed;
+		}
+		if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+			DEBUG(0,("Locking shared memory file failed: %s: %s\n",
+				path, strerror(errno)));
+			goto svf_shm_new_failed;
+		}
+
+		if (st.st_size == 0) {
+			/* New file */
+			header.magic = magic;
+			header.data_size = data_size;
+			if (ftruncate(fd, sizeof(header) + data_size) == -1 ||
+			    pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+				DEBUG(0,("Initializing shared memory file failed: %s: %s\n",
+					path, strerror(errno)));
+				goto svf_shm_new_failed;
+			}
+			break;
+		}
+
+		if (st.st_size >= sizeof(header) &&
+		    pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+		    header.magic == magic &&
+		    st.st_size == sizeof(header) + header.data_size) {
+			/* Existing file */
+			if (header.data_size != data_size) {
+				DEBUG(3,("Using existing shared memory file with "
+					"different size: %s: %lu\n",
+					path, (unsigned long)header.data_size));
+			}
+			break;
+		}
+
+		/*
+		 * Invalid file: Replace it. Processes that still map the
+		 * old file are not affected.
+		 */
+		DEBUG(1,("Replacing invalid shared memory file: %s\n", path));
+		unlink(path);
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1) {
+		goto svf_shm_new_failed;
+	}
+
+	shm_h->map_size = sizeof(header) + header.data_size;
+	shm_h->map = mmap(NULL, shm_h->map_size, PROT_READ|PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (shm_h->map == MAP_FAILED) {
+		DEBUG(0,("Mapping shared memory file failed: %s: %s\n",
+			path, strerror(errno)));
+		goto svf_shm_new_failed;
+	}
+	shm_h->data = (char *)shm_h->map + sizeof(header);
+	shm_h->data_size = header.data_size;
 
-	cache_e->fname_len = (fname_len >= 0) ? fname_len : strlen(fname);
+	close(fd); /* Also releases the lock */
 
-	return cache_e;
+	return shm_h;
+
+svf_shm_new_failed:
+	if (fd != -1) {
+		close(fd);
+	}
+	TALLOC_FREE(shm_h);
+
+	return NULL;
 }
 
-void svf_cache_purge(svf_cache_handle *cache_h)
+/* Generic "stupid" cache
+ * ====================================================================== */
+
+/* FNV-1a */
+static uint32_t svf_cache_hash(const char *fname, int fname_len)
 {
-	svf_cache_entry *cache_e;
-	time_t time_now = time(NULL);
+	uint32_t hash = 2166136261U;
+	const unsigned char *p = (const unsigned char *)fname;
+	const unsigned char *p_end = p + fname_len;
 
-	DEBUG(10,("Crawling cache entries to find purge entry\n"));
+	while (p < p_end) {
+		hash ^= *p++;
+		hash *= 16777619U;
+	}
 
-	for (cache_e = cache_h->end; cache_e; cache_e = cache_h->end) {
-		time_t time_age = time_now - cache_e->time;
-		DEBUG(10,("Checking cache entry: fname=%s, age=%ld\n", cache_e->fname, (long)time_age));
-		if (cache_h->entry_num <= cache_h->entry_limit &&
-		    time_age < cache_h->time_limit) {
-			break;
-		}
+	return hash;
+}
 
-		svf_cache_remove(cache_h, cache_e);
-		svf_cache_entry_free(cache_e);
+static void svf_cache_hash_link(svf_cache_handle *cache_h, svf_cache_entry *cache_e)
+{
+	svf_cache_entry **bucket =
+		&cache_h->hash_table[cache_e->fname_hash & (cache_h->hash_size - 1)];
+
+	cache_e->hash_next = *bucket;
+	if (cache_e->hash_next) {
+		cache_e->hash_next->hash_pprev = &cache_e->hash_next;
 	}
+	cache_e->hash_pprev = bucket;
+	*bucket = cache_e;
 }
 
-svf_cache_entry *svf_cache_get(svf_cache_handle *cache_h, const char *fname, int fname_len)
+static void svf_cache_hash_unlink(svf_cache_entry *cache_e)
 {
-	svf_cache_entry *cache_e;
+	if (!cache_e->hash_pprev) {
+		return;
+	}
 
-	svf_cache_purge(cache_h);
+	*cache_e->hash_pprev = cache_e->hash_next;
+	if (cache_e->hash_next) {
+		cache_e->hash_next->hash_pprev = cache_e->hash_pprev;
+	}
+	cache_e->hash_next = NULL;
+	cache_e->hash_pprev = NULL;
+}
 
-	if (fname_len <= 0) {
-		fname_len = strlen(fname);
+static bool svf_cache_hash_resize(svf_cache_handle *cache_h, uint32_t hash_size)
+{
+	svf_cache_entry **hash_table;
+	svf_cache_entry *cache_e;
+
+	hash_table = TALLOC_ZERO_ARRAY(cache_h, svf_cache_entry *, hash_size);
+	if (!hash_table) {
+		DEBUG(0,("TALLOC_ZERO_ARRAY failed\n"));
+		return false;
 	}
 
-	DEBUG(10,("Searching cache entry: fname=%s\n", fname));
+	TALLOC_FREE(cache_h->hash_table);
+	cache_h->hash_table = hash_table;
+	cache_h->hash_size = hash_size;
 
 	for (cache_e = cache_h->list; cache_e; cache_e = cache_e->next) {
-		DEBUG(10,("Checking cache entry: fname=%s\n", cache_e->fname));
-		if (cache_e->fname_len == fname_len && str_eq(cache_e->fname, fname)) {
-			break;
-		}
+		svf_cache_hash_link(cache_h, cache_e);
 	}
 
-	return cache_e;
+	return true;
 }
 
-void svf_cache_add(svf_cache_handle *cache_h, svf_cache_entry *cache_e)
+/* Link to the wheel slot processed when the entry is due, or when it is
+   cascaded to a finer wheel, so that no entry is visited before then */
+static void svf_cache_wheel_link(svf_cache_handle *cache_h, svf_cache_entry *cache_e)
 {
-	cache_e->fname_len = strlen(cache_e->fname);
-	cache_e->time = time(NULL);
+	time_t base = cache_h->wheel_time;
+	svf_cache_entry **slot;
+
+	if (cache_e->expire < base + SVF_CACHE_WHEEL_SIZE) {
+		slot = &cache_h->wheel[MAX(cache_e->expire, base) &
+			(SVF_CACHE_WHEEL_SIZE - 1)];
+	} else if (cache_e->expire / SVF_CACHE_WHEEL_SIZE <
+		   base / SVF_CACHE_WHEEL_SIZE + SVF_CACHE_WHEEL_SIZE) {
+		slot = &cache_h->wheel_coarse[
+			(cache_e->expire / SVF_CACHE_WHEEL_SIZE) &
+			(SVF_CACHE_WHEEL_SIZE - 1)];
+	} else {
+		slot = &cache_h->wheel_far;
+	}
 
-	DLIST_ADD(cache_h->list, cache_e);
+	cache_e->wheel_next = *slot;
+	if (cache_e->wheel_next) {
+		cache_e->wheel_next->wheel_pprev = &cache_e->wheel_next;
+	}
+	cache_e->wheel_pprev = slot;
+	*slot = cache_e;
+}
 
-	cache_h->entry_num++;
-	if (!cache_h->end) {
-		cache_h->end = cache_e;
+static void svf_cache_wheel_unlink(svf_cache_entry *cache_e)
+{
+	if (!cache_e->wheel_pprev) {
+		return;
 	}
 
-	svf_cache_purge(cache_h);
+	*cache_e->wheel_pprev = cache_e->wheel_next;
+	if (cache_e->wheel_next) {
+		cache_e->wheel_next->wheel_pprev = cache_e->wheel_pprev;
+	}
+	cache_e->wheel_next = NULL;
+	cache_e->wheel_pprev = NULL;
 }
 
-void svf_cache_remove(svf_cache_handle *cache_h, svf_cache_entry *cache_e)
+/* Move the entries in a slot to the slots for the current wheel time */
+static void svf_cache_wheel_cascade(svf_cache_handle *cache_h, svf_cache_entry **slot)
+{
+	svf_cache_entry *cache_e, *cache_e_next;
+
+	for (cache_e = *slot; cache_e; cache_e = cache_e_next) {
+		cache_e_next = cache_e->wheel_next;
+		svf_cache_wheel_unlink(cache_e);
+		svf_cache_wheel_link(cache_h, cache_e);
+	}
+}
+
+static bool svf_cache_validator_eq(
+	const SMB_STRUCT_STAT *st,
+	int64_t size,
+	int64_t mtime_sec, int64_t mtime_nsec,
+	int64_t ctime_sec, int64_t ctime_nsec)
+{
+	return (size == (int64_t)st->st_ex_size &&
+		mtime_sec == (int64_t)st->st_ex_mtime.tv_sec &&
+		mtime_nsec == (int64_t)st->st_ex_mtime.tv_nsec &&
+		ctime_sec == (int64_t)st->st_ex_ctime.tv_sec &&
+		ctime_nsec == (int64_t)st->st_ex_ctime.tv_nsec);
+}
+
+static uint32_t svf_shm_cache_hash(dev_t dev, ino_t ino)
 {
-	cache_e->fname_len = strlen(cache_e->fname);
-	cache_e->time = time(NULL);
+	uint64_t id[2];
 
-	DEBUG(10,("Purging cache entry: %s\n", cache_e->fname));
+	id[0] = dev;
+	id[1] = ino;
 
-	if (cache_h->end == cache_e) {
-		cache_h->end = cache_e->prev;
+	return svf_cache_hash((const char *)id, sizeof(id));
+}
+
+static volatile uint32_t *svf_cache_inval_counter(
+	svf_cache_inval_handle *inval_h,
+	dev_t dev,
+	ino_t ino)
+{
+	uint32_t hash = svf_shm_cache_hash(dev, ino);
+
+	return &inval_h->counters[hash & (inval_h->counter_num - 1)];
+}
+
+static bool svf_shm_cache_get(
+	svf_shm_cache_handle *shm_cache_h,
+	uint32_t generation,
+	const SMB_STRUCT_STAT *st,
+	svf_result *resultp,
+	time_t *timep,
+	char *report,
+	size_t report_size)
+{
+	uint32_t hash = svf_shm_cache_hash(st->st_ex_dev, st->st_ex_ino);
+	svf_shm_cache_slot *slot;
+	svf_shm_cache_slot slot_copy;
+	uint32_t seq;
+	int probe, retry;
+
+	for (probe = 0; probe < SVF_SHM_CACHE_PROBE_MAX; probe++) {
+		slot = &shm_cache_h->slots[(hash + probe) & (shm_cache_h->slot_num - 1)];
+
+		for (retry = 0; retry < 3; retry++) {
+			seq = slot->seq;
+			if (seq & 1) {
+				continue;
+			}
+			__sync_synchronize();
+			memcpy(&slot_copy, (const void *)slot, sizeof(slot_copy));
+			__sync_synchronize();
+			if (slot->seq == seq) {
+				break;
+			}
+		}
+		if (retry == 3) {
+			/* Being updated by another process */
+			continue;
+		}
+
+		if (seq == 0) {
+			/* Empty slot terminates the probe sequence */
+			return false;
+		}
+		if (slot_copy.dev != (uint64_t)st->st_ex_dev ||
+		    slot_copy.ino != (uint64_t)st->st_ex_ino) {
+			continue;
+		}
+
+		if (slot_copy.generation != generation ||
+		    !svf_cache_validator_eq(st, slot_copy.size,
+		    slot_copy.mtime_sec, slot_copy.mtime_nsec,
+		    slot_copy.ctime_sec, slot_copy.ctime_nsec)) {
+			return false;
+		}
+
+		*resultp = (svf_result)slot_copy.result;
+		*timep = slot_copy.time;
+		slot_copy.report[sizeof(slot_copy.report) - 1] = '\0';
+		strlcpy(report, slot_copy.report, report_size);
+
+		return true;
 	}
-	cache_h->entry_num--;
-	DLIST_REMOVE(cache_h->list, cache_e);
+
+	return false;
+}
+
+static void svf_shm_cache_put(
+	svf_shm_cache_handle *shm_cache_h,
+	uint32_t generation,
+	const svf_cache_entry *cache_e)
+{
+	uint32_t hash = svf_shm_cache_hash(cache_e->dev, cache_e->ino);
+	svf_shm_cache_slot *slot, *slot_victim = NULL;
+	uint32_t seq;
+	int probe;
+
+	/* Reuse the slot for the file, an empty slot or the oldest slot */
+	for (probe = 0; probe < SVF_SHM_CACHE_PROBE_MAX; probe++) {
+		slot = &shm_cache_h->slots[(hash + probe) & (shm_cache_h->slot_num - 1)];
+		if (slot->seq == 0 ||
+		    (slot->dev == (uint64_t)cache_e->dev &&
+		     slot->ino == (uint64_t)cache_e->ino)) {
+			slot_victim = slot;
+			break;
+		}
+		if (!slot_victim || slot->time < slot_victim->time) {
+			slot_victim = slot;
+		}
+	}
+
+	seq = slot_victim->seq;
+	if ((seq & 1) ||
+	    !__sync_bool_compare_and_swap(&slot_victim->seq, seq, seq + 1)) {
+		/* Being updated by another process */
+		return;
+	}
+
+	slot_victim->result = cache_e->result;
+	slot_victim->generation = generation;
+	slot_victim->dev = cache_e->dev;
+	slot_victim->ino = cache_e->ino;
+	slot_victim->size = cache_e->size;
+	slot_victim->mtime_sec = cache_e->mtime.tv_sec;
+	slot_victim->mtime_nsec = cache_e->mtime.tv_nsec;
+	slot_victim->ctime_sec = cache_e->ctime.tv_sec;
+	slot_victim->ctime_nsec = cache_e->ctime.tv_nsec;
+	slot_victim->time = cache_e->time;
+	strlcpy(slot_victim->report, cache_e->report ? cache_e->report : "",
+		sizeof(slot_victim->report));
+
+	__sync_synchronize();
+	slot_victim->seq = seq + 2;
+}
+
+static TDB_DATA svf_tdb_cache_key(uint64_t *id, dev_t dev, ino_t ino)
+{
+	id[0] = dev;
+	id[1] = ino;
+
+	return make_tdb_data((const uint8_t *)id, sizeof(uint64_t) * 2);
+}
+
+/* Fetch a record allocated on talloc_tos() from tdb or dbwrap */
+static TDB_DATA svf_tdb_cache_fetch(
+	svf_tdb_cache_handle *tdb_cache_h,
+	TDB_DATA key)
+{
+	TDB_DATA data, data_tos;
+
+	if (tdb_cache_h->db) {
+		return dbwrap_fetch(tdb_cache_h->db, talloc_tos(), key);
+	}
+
+	data = tdb_fetch(tdb_cache_h->tdb_w->tdb, key);
+	if (!data.dptr) {
+		return data;
+	}
+	data_tos = make_tdb_data((const uint8_t *)talloc_memdup(talloc_tos(),
+		data.dptr, data.dsize), data.dsize);
+	SAFE_FREE(data.dptr);
+
+	return data_tos;
+}
+
+static bool svf_tdb_cache_store(
+	svf_tdb_cache_handle *tdb_cache_h,
+	TDB_DATA key,
+	TDB_DATA data)
+{
+	if (tdb_cache_h->db) {
+		return NT_STATUS_IS_OK(dbwrap_store(tdb_cache_h->db,
+			key, data, TDB_REPLACE));
+	}
+
+	return (tdb_store(tdb_cache_h->tdb_w->tdb, key, data, TDB_REPLACE) == 0);
+}
+
+static bool svf_tdb_cache_get(
+	svf_tdb_cache_handle *tdb_cache_h,
+	uint32_t generation,
+	const SMB_STRUCT_STAT *st,
+	svf_result *resultp,
+	time_t *timep,
+	char *report,
+	size_t report_size)
+{
+	uint64_t id[2];
+	TDB_DATA data;
+	svf_tdb_cache_record record;
+	bool found = false;
+
+	data = svf_tdb_cache_fetch(tdb_cache_h,
+		svf_tdb_cache_key(id, st->st_ex_dev, st->st_ex_ino));
+	if (!data.dptr) {
+		return false;
+	}
+
+	if (data.dsize <= sizeof(record) || data.dptr[data.dsize - 1] != '\0') {
+		goto svf_tdb_cache_get_done;
+	}
+	memcpy(&record, data.dptr, sizeof(record));
+	if (record.version != SVF_TDB_CACHE_VERSION ||
+	    record.generation != generation) {
+		goto svf_tdb_cache_get_done;
+	}
+	if (!svf_cache_validator_eq(st, record.size,
+	    record.mtime_sec, record.mtime_nsec,
+	    record.ctime_sec, record.ctime_nsec)) {
+		goto svf_tdb_cache_get_done;
+	}
+
+	*resultp = (svf_result)record.result;
+	*timep = record.time;
+	strlcpy(report, (const char *)data.dptr + sizeof(record), report_size);
+	found = true;
+
+svf_tdb_cache_get_done:
+	TALLOC_FREE(data.dptr);
+
+	return found;
+}
+
+/* Compact the records if no process has done it in the last
+   SVF_TDB_CACHE_COMPACT_INTERVAL. This traverses the whole database:
+   Call it out of client requests */
+void svf_tdb_cache_compact_if_due(svf_tdb_cache_handle *tdb_cache_h)
+{
+	TDB_DATA key = string_term_tdb_data(SVF_TDB_CACHE_COMPACT_KEY);
+	TDB_DATA data;
+	int64_t time_now = time(NULL);
+	int64_t time_last = 0;
+
+	if (tdb_cache_h->size_limit <= 0) {
+		return;
+	}
+
+	data = svf_tdb_cache_fetch(tdb_cache_h, key);
+	if (data.dptr && data.dsize == sizeof(time_last)) {
+		memcpy(&time_last, data.dptr, sizeof(time_last));
+	}
+	TALLOC_FREE(data.dptr);
+	if (time_last + SVF_TDB_CACHE_COMPACT_INTERVAL > time_now) {
+		return;
+	}
+
+	svf_tdb_cache_store(tdb_cache_h, key,
+		make_tdb_data((const uint8_t *)&time_now, sizeof(time_now)));
+
+	svf_tdb_cache_compact(tdb_cache_h);
+}
+
+static void svf_tdb_cache_put(
+	svf_tdb_cache_handle *tdb_cache_h,
+	uint32_t generation,
+	const svf_cache_entry *cache_e)
+{
+	const char *report = cache_e->report ? cache_e->report : "";
+	size_t report_size = strlen(report) + 1;
+	svf_tdb_cache_record *record;
+	size_t record_size = sizeof(*record) + report_size;
+	uint64_t id[2];
+
+	record = (svf_tdb_cache_record *)talloc_zero_size(talloc_tos(), record_size);
+	if (!record) {
+		DEBUG(0,("talloc_zero_size failed\n"));
+		return;
+	}
+
+	record->version = SVF_TDB_CACHE_VERSION;
+	record->result = cache_e->result;
+	record->generation = generation;
+	record->size = cache_e->size;
+	record->mtime_sec = cache_e->mtime.tv_sec;
+	record->mtime_nsec = cache_e->mtime.tv_nsec;
+	record->ctime_sec = cache_e->ctime.tv_sec;
+	record->ctime_nsec = cache_e->ctime.tv_nsec;
+	record->time = cache_e->time;
+	memcpy((char *)(record + 1), report, report_size);
+
+	if (!svf_tdb_cache_store(tdb_cache_h,
+	    svf_tdb_cache_key(id, cache_e->dev, cache_e->ino),
+	    make_tdb_data((const uint8_t *)record, record_size))) {
+		DEBUG(3,("Storing persistent cache record failed: %s\n",
+			cache_e->fname));
+	}
+
+	TALLOC_FREE(record);
+}
+
+static uint32_t svf_cache_dir_hash(
+	const svf_cache_dir *parent,
+	const char *name,
+	int name_len)
+{
+	uint64_t parent_id = (uintptr_t)parent;
+
+	return svf_cache_hash(name, name_len) ^
+		(uint32_t)((parent_id >> 4) * 2654435761U);
+}
+
+static void svf_cache_dir_hash_link(svf_cache_handle *cache_h, svf_cache_dir *dir)
+{
+	svf_cache_dir **bucket =
+		&cache_h->dir_table[dir->hash & (cache_h->dir_hash_size - 1)];
+
+	dir->hash_next = *bucket;
+	if (dir->hash_next) {
+		dir->hash_next->hash_pprev = &dir->hash_next;
+	}
+	dir->hash_pprev = bucket;
+	*bucket = dir;
+}
+
+static void svf_cache_dir_hash_unlink(svf_cache_handle *cache_h, svf_cache_dir *dir)
+{
+	if (!dir->hash_pprev) {
+		return;
+	}
+
+	*dir->hash_pprev = dir->hash_next;
+	if (dir->hash_next) {
+		dir->hash_next->hash_pprev = dir->hash_pprev;
+	}
+	dir->hash_next = NULL;
+	dir->hash_pprev = NULL;
+	cache_h->dir_num--;
+}
+
+static bool svf_cache_dir_hash_resize(svf_cache_handle *cache_h, uint32_t hash_size)
+{
+	svf_cache_dir **dir_table_old = cache_h->dir_table;
+	uint32_t hash_size_old = cache_h->dir_hash_size;
+	svf_cache_dir *dir, *dir_next;
+	uint32_t i;
+
+	cache_h->dir_table = TALLOC_ZERO_ARRAY(cache_h, svf_cache_dir *, hash_size);
+	if (!cache_h->dir_table) {
+		DEBUG(0,("TALLOC_ZERO_ARRAY failed\n"));
+		cache_h->dir_table = dir_table_old;
+		return false;
+	}
+	cache_h->dir_hash_size = hash_size;
+
+	for (i = 0; i < hash_size_old; i++) {
+		for (dir = dir_table_old[i]; dir; dir = dir_next) {
+			dir_next = dir->hash_next;
+			svf_cache_dir_hash_link(cache_h, dir);
+		}
+	}
+	TALLOC_FREE(dir_table_old);
+
+	return true;
+}
+
+/* Drop a reference, and free the directory (and parents) if unused */
+static void svf_cache_dir_unref(svf_cache_handle *cache_h, svf_cache_dir *dir)
+{
+	svf_cache_dir *parent;
+
+	while (dir && --dir->ref_count <= 0) {
+		parent = dir->parent;
+		svf_cache_dir_hash_unlink(cache_h, dir);
+		cache_h->mem_size -= talloc_get_size(dir);
+		TALLOC_FREE(dir);
+		dir = parent;
+	}
+}
+
+/*
+ * Find the directory by the path, or create it if create is true.
+ * A reference is added to the returned directory for the caller.
+ * Returns false if not found or on allocation failure.
+ */
+static bool svf_cache_dir_get(
+	svf_cache_handle *cache_h,
+	const char *dname,
+	int dname_len,
+	bool create,
+	svf_cache_dir **dirp)
+{
+	const char *p = dname, *p_end = dname + dname_len;
+	svf_cache_dir *parent = NULL, *dir = NULL;
+
+	while (p < p_end) {
+		const char *name = p;
+		int name_len;
+		uint32_t hash;
+
+		while (p < p_end && *p != '/') {
+			p++;
+		}
+		name_len = p - name;
+		p++;
+		if (name_len == 0) {
+			continue;
+		}
+
+		hash = svf_cache_dir_hash(parent, name, name_len);
+		for (dir = cache_h->dir_table[hash & (cache_h->dir_hash_size - 1)];
+		     dir;
+		     dir = dir->hash_next) {
+			if (dir->hash == hash && dir->parent == parent &&
+			    dir->name_len == name_len &&
+			    memcmp(dir->name, name, name_len) == 0) {
+				break;
+			}
+		}
+
+		if (!dir) {
+			if (!create) {
+				return false;
+			}
+			dir = (svf_cache_dir *)talloc_size(cache_h,
+				offsetof(svf_cache_dir, name) + name_len + 1);
+			if (!dir) {
+				DEBUG(0,("talloc_size failed\n"));
+				if (parent) {
+					/* Free directories created above */
+					parent->ref_count++;
+					svf_cache_dir_unref(cache_h, parent);
+				}
+				return false;
+			}
+			dir->parent = parent;
+			dir->hash = hash;
+			dir->ref_count = 0;
+			dir->dead = false;
+			dir->name_len = name_len;
+			memcpy(dir->name, name, name_len);
+			dir->name[name_len] = '\0';
+			svf_cache_dir_hash_link(cache_h, dir);
+			cache_h->dir_num++;
+			cache_h->mem_size += talloc_get_size(dir);
+			if (parent) {
+				parent->ref_count++;
+			}
+		}
+
+		parent = dir;
+	}
+
+	if (dir) {
+		dir->ref_count++;
+	}
+	*dirp = dir;
+
+	if (cache_h->dir_num > cache_h->dir_hash_size &&
+	    cache_h->dir_hash_size < SVF_CACHE_HASH_SIZE_MAX) {
+		svf_cache_dir_hash_resize(cache_h, cache_h->dir_hash_size * 2);
+	}
+
+	return true;
+}
+
+static bool svf_cache_dir_is_dead(const svf_cache_dir *dir)
+{
+	for (; dir; dir = dir->parent) {
+		if (dir->dead) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Set the directory of the entry by its name */
+static bool svf_cache_entry_link_dir(svf_cache_handle *cache_h, svf_cache_entry *cache_e)
+{
+	const char *slash = NULL;
+	int i;
+
+	for (i = cache_e->fname_len - 1; i >= 0; i--) {
+		if (cache_e->fname[i] == '/') {
+			slash = cache_e->fname + i;
+			break;
+		}
+	}
+
+	cache_e->dir = NULL;
+	if (!slash) {
+		return true;
+	}
+
+	return svf_cache_dir_get(cache_h, cache_e->fname,
+		slash - cache_e->fname, true, &cache_e->dir);
+}
+
+svf_cache_handle *svf_cache_new(TALLOC_CTX *ctx, int entry_limit, time_t time_limit)
+{
+	svf_cache_handle *cache_h = TALLOC_ZERO_P(ctx, svf_cache_handle);
+	if (!cache_h) {
+		DEBUG(0,("TALLOC_ZERO_P failed\n"));
+		return NULL;
+	}
+	cache_h->entry_limit = entry_limit;
+	cache_h->time_limit = time_limit;
+	cache_h->time_now = time(NULL);
+	cache_h->wheel_time = cache_h->time_now;
+	cache_h->clean_time_limit = -1;
+	cache_h->infected_time_limit = -1;
+	cache_h->error_time_limit = -1;
+
+	/* The hash tables grow on demand */
+	if (!svf_cache_hash_resize(cache_h, SVF_CACHE_HASH_SIZE_MIN) ||
+	    !svf_cache_dir_hash_resize(cache_h, SVF_CACHE_HASH_SIZE_MIN)) {
+		TALLOC_FREE(cache_h);
+		return NULL;
+	}
+
+	return cache_h;
+}
+
+/* Excess entries are dropped by the next svf_cache_get() */
+void svf_cache_set_limits(svf_cache_handle *cache_h, int entry_limit, time_t time_limit)
+{
+	cache_h->entry_limit = entry_limit;
+	cache_h->time_limit = time_limit;
+}
+
+void svf_cache_set_size_limit(svf_cache_handle *cache_h, size_t size_limit)
+{
+	cache_h->size_limit = size_limit;
+}
+
+void svf_cache_set_result_time_limits(
+	svf_cache_handle *cache_h,
+	time_t clean_time_limit,
+	time_t infected_time_limit,
+	time_t error_time_limit)
+{
+	cache_h->clean_time_limit = clean_time_limit;
+	cache_h->infected_time_limit = infected_time_limit;
+	cache_h->error_time_limit = error_time_limit;
+}
+
+static time_t svf_cache_result_time_limit(
+	svf_cache_handle *cache_h,
+	svf_result result)
+{
+	switch (result) {
+	case SVF_RESULT_CLEAN:
+		return cache_h->clean_time_limit;
+	case SVF_RESULT_INFECTED:
+		return cache_h->infected_time_limit;
+	default:
+		return cache_h->error_time_limit;
+	}
+}
+
+static size_t svf_cache_entry_mem_size(const svf_cache_entry *cache_e)
+{
+	/* Reports are counted when they are interned */
+	return sizeof(*cache_e) + (cache_e->fname == cache_e->fname_inline ?
+		0 : cache_e->fname_len + 1);
+}
+
+/* Returns false and keeps the current name if allocation fails */
+static bool svf_cache_entry_set_fname(
+	svf_cache_entry *cache_e,
+	const char *fname,
+	int fname_len)
+{
+	char *fname_new;
+
+	if (fname_len < 0) {
+		fname_len = strlen(fname);
+	}
+
+	if (fname_len < SVF_CACHE_FNAME_INLINE_SIZE) {
+		fname_new = cache_e->fname_inline;
+	} else {
+		fname_new = talloc_strndup(cache_e->cache_h, fname, fname_len);
+		if (!fname_new) {
+			DEBUG(0,("talloc_strndup failed\n"));
+			return false;
+		}
+	}
+
+	if (cache_e->fname && cache_e->fname != cache_e->fname_inline) {
+		TALLOC_FREE(cache_e->fname);
+	}
+	if (fname_new == cache_e->fname_inline) {
+		memmove(fname_new, fname, fname_len);
+		fname_new[fname_len] = '\0';
+	}
+
+	cache_e->fname = fname_new;
+	cache_e->fname_len = fname_len;
+	cache_e->fname_hash = svf_cache_hash(cache_e->fname, cache_e->fname_len);
+
+	return true;
+}
+
+static void svf_cache_report_release(svf_cache_handle *cache_h, const char *report)
+{
+	svf_cache_report *report_i, **report_pp;
+
+	if (!report) {
+		return;
+	}
+
+	report_i = (svf_cache_report *)(report - offsetof(svf_cache_report, str));
+	if (--report_i->ref_count > 0) {
+		return;
+	}
+
+	for (report_pp = &cache_h->report_table[report_i->hash & (SVF_CACHE_REPORT_HASH_SIZE - 1)];
+	     *report_pp;
+	     report_pp = &(*report_pp)->next) {
+		if (*report_pp == report_i) {
+			*report_pp = report_i->next;
+			break;
+		}
+	}
+
+	cache_h->mem_size -= talloc_get_size(report_i);
+	TALLOC_FREE(report_i);
+}
+
+/* Share the report string with other entries ("Clean", virus names...) */
+bool svf_cache_entry_set_report(svf_cache_entry *cache_e, const char *report)
+{
+	svf_cache_handle *cache_h = cache_e->cache_h;
+	svf_cache_report *report_i = NULL;
+	svf_cache_report **bucket;
+	size_t report_len;
+	uint32_t hash;
+
+	if (report) {
+		report_len = strlen(report);
+		hash = svf_cache_hash(report, report_len);
+		bucket = &cache_h->report_table[hash & (SVF_CACHE_REPORT_HASH_SIZE - 1)];
+
+		for (report_i = *bucket; report_i; report_i = report_i->next) {
+			if (report_i->hash == hash && str_eq(report_i->str, report)) {
+				break;
+			}
+		}
+		if (!report_i) {
+			report_i = (svf_cache_report *)talloc_size(cache_h,
+				offsetof(svf_cache_report, str) + report_len + 1);
+			if (!report_i) {
+				DEBUG(0,("talloc_size failed\n"));
+				return false;
+			}
+			report_i->hash = hash;
+			report_i->ref_count = 0;
+			memcpy(report_i->str, report, report_len + 1);
+			report_i->next = *bucket;
+			*bucket = report_i;
+			cache_h->mem_size += talloc_get_size(report_i);
+		}
+		report_i->ref_count++;
+	}
+
+	svf_cache_report_release(cache_h, cache_e->report);
+	cache_e->report = report_i ? report_i->str : NULL;
+
+	return true;
+}
+
+svf_cache_entry *svf_cache_entry_new(
+	svf_cache_handle *cache_h,
+	const char *fname,
+	int fname_len)
+{
+	svf_cache_slab *slab = cache_h->slabs;
+	svf_cache_entry *cache_e;
+	int i;
+
+	if (!slab) {
+		slab = TALLOC_P(cache_h, svf_cache_slab);
+		if (!slab) {
+			DEBUG(0,("TALLOC_P failed\n"));
+			return NULL;
+		}
+		slab->free_list = NULL;
+		slab->used_num = 0;
+		for (i = 0; i < SVF_CACHE_SLAB_SIZE; i++) {
+			slab->entries[i].hash_next = slab->free_list;
+			slab->free_list = &slab->entries[i];
+		}
+		DLIST_ADD(cache_h->slabs, slab);
+	}
+
+	cache_e = slab->free_list;
+	slab->free_list = cache_e->hash_next;
+	slab->used_num++;
+	if (!slab->free_list) {
+		/* Full */
+		DLIST_REMOVE(cache_h->slabs, slab);
+	}
+
+	ZERO_STRUCTP(cache_e);
+	cache_e->cache_h = cache_h;
+	cache_e->slab = slab;
+
+	if (!svf_cache_entry_set_fname(cache_e, fname, fname_len)) {
+		svf_cache_entry_free(cache_e);
+		return NULL;
+	}
+
+	return cache_e;
+}
+
+void svf_cache_entry_set_cost(svf_cache_entry *cache_e, int64_t scan_usec)
+{
+	int64_t scan_msec = scan_usec / 1000;
+	uint8_t cost_level = 0;
+
+	while (scan_msec > 1 && cost_level < SVF_CACHE_COST_LEVEL_MAX) {
+		scan_msec >>= 1;
+		cost_level++;
+	}
+
+	cache_e->cost_level = cost_level;
+}
+
+/* The entry must not be linked to the cache */
+void svf_cache_entry_free(svf_cache_entry *cache_e)
+{
+	svf_cache_handle *cache_h;
+	svf_cache_slab *slab;
+
+	if (!cache_e) {
+		return;
+	}
+	cache_h = cache_e->cache_h;
+	slab = cache_e->slab;
+
+	svf_cache_report_release(cache_h, cache_e->report);
+	cache_e->report = NULL;
+	if (cache_e->fname && cache_e->fname != cache_e->fname_inline) {
+		TALLOC_FREE(cache_e->fname);
+	}
+	cache_e->fname = NULL;
+
+	if (!slab->free_list) {
+		/* Was full */
+		DLIST_ADD_END(cache_h->slabs, slab, svf_cache_slab *);
+	}
+	cache_e->hash_next = slab->free_list;
+	slab->free_list = cache_e;
+	slab->used_num--;
+
+	/* Keep a slab to not allocate one again for the next entry */
+	if (slab->used_num == 0 && cache_h->slabs->next) {
+		DLIST_REMOVE(cache_h->slabs, slab);
+		TALLOC_FREE(slab);
+	}
+}
+
+svf_cache_entry *svf_cache_entry_rename(
+	svf_cache_handle *cache_h,
+	svf_cache_entry *cache_e,
+	const char *fname,
+	int fname_len)
+{
+	bool is_linked = (cache_e->hash_pprev != NULL);
+
+	svf_cache_hash_unlink(cache_e);
+
+	if (!svf_cache_entry_set_fname(cache_e, fname, fname_len)) {
+		if (is_linked) {
+			svf_cache_remove(cache_h, cache_e);
+		}
+		svf_cache_entry_free(cache_e);
+		return NULL;
+	}
+
+	if (is_linked) {
+		svf_cache_dir_unref(cache_h, cache_e->dir);
+		if (!svf_cache_entry_link_dir(cache_h, cache_e)) {
+			svf_cache_remove(cache_h, cache_e);
+			svf_cache_entry_free(cache_e);
+			return NULL;
+		}
+		svf_cache_hash_link(cache_h, cache_e);
+		cache_h->mem_size -= cache_e->mem_size;
+		cache_e->mem_size = svf_cache_entry_mem_size(cache_e);
+		cache_h->mem_size += cache_e->mem_size;
+	}
+
+	return cache_e;
+}
+
+#define svf_timespec_eq(ts1, ts2) \
+	((ts1).tv_sec == (ts2).tv_sec && (ts1).tv_nsec == (ts2).tv_nsec)
+
+void svf_cache_entry_set_validator(svf_cache_entry *cache_e, const SMB_STRUCT_STAT *st)
+{
+	time_t time_now = time(NULL);
+
+	cache_e->has_validator = false;
+
+	if (!st || !VALID_STAT(*st)) {
+		return;
+	}
+
+	/*
+	 * A file changed just before the scan may be changed again
+	 * without any visible change in its timestamps.
+	 * Such an entry expires by the time limit.
+	 */
+	if (st->st_ex_mtime.tv_sec + SVF_CACHE_VALIDATOR_RACY_TIME >= time_now ||
+	    st->st_ex_ctime.tv_sec + SVF_CACHE_VALIDATOR_RACY_TIME >= time_now) {
+		DEBUG(10,("Not setting cache validator: Recently changed file: %s\n",
+			cache_e->fname));
+		return;
+	}
+
+	cache_e->dev = st->st_ex_dev;
+	cache_e->ino = st->st_ex_ino;
+	cache_e->size = st->st_ex_size;
+	cache_e->mtime = st->st_ex_mtime;
+	cache_e->ctime = st->st_ex_ctime;
+	cache_e->has_validator = true;
+}
+
+/* Set the invalidation counter sampled by svf_cache_inval_seq() before the scan */
+void svf_cache_entry_set_inval_seq(
+	svf_cache_entry *cache_e,
+	const SMB_STRUCT_STAT *st,
+	uint32_t inval_seq)
+{
+	cache_e->has_inval_seq = false;
+
+	if (!st || !VALID_STAT(*st)) {
+		return;
+	}
+
+	cache_e->dev = st->st_ex_dev;
+	cache_e->ino = st->st_ex_ino;
+	cache_e->inval_seq = inval_seq;
+	cache_e->has_inval_seq = true;
+}
+
+static bool svf_cache_entry_is_valid(
+	svf_cache_handle *cache_h,
+	svf_cache_entry *cache_e,
+	const SMB_STRUCT_STAT *st)
+{
+	if (cache_e->generation != cache_h->generation) {
+		/* Scanned with another signature database */
+		return false;
+	}
+
+	if (cache_e->expire && cache_h->time_now >= cache_e->expire) {
+		return false;
+	}
+
+	if (svf_cache_dir_is_dead(cache_e->dir)) {
+		/* A directory in the path has been renamed or removed */
+		return false;
+	}
+
+	if (cache_h->inval_h && cache_e->has_inval_seq &&
+	    *svf_cache_inval_counter(cache_h->inval_h,
+	    cache_e->dev, cache_e->ino) != cache_e->inval_seq) {
+		/* Changed by another process (or this one) */
+		return false;
+	}
+
+	if (!cache_e->has_validator) {
+		/* No validator: Trust the entry until the time limit */
+		return true;
+	}
+
+	if (!st) {
+		/* No way to validate, but the file name matches */
+		return true;
+	}
+
+	/* Validator: Authoritative regardless of its age */
+	return (VALID_STAT(*st) &&
+		cache_e->dev == st->st_ex_dev &&
+		cache_e->ino == st->st_ex_ino &&
+		cache_e->size == st->st_ex_size &&
+		svf_timespec_eq(cache_e->mtime, st->st_ex_mtime) &&
+		svf_timespec_eq(cache_e->ctime, st->st_ex_ctime));
+}
+
+/* Move the entry at the tail to the head of the list */
+static void svf_cache_rotate(svf_cache_handle *cache_h, svf_cache_entry *cache_e)
+{
+	cache_h->end = (cache_e == cache_h->list) ? NULL : cache_e->prev;
+	DLIST_REMOVE(cache_h->list, cache_e);
+	DLIST_ADD(cache_h->list, cache_e);
+	if (!cache_h->end) {
+		cache_h->end = cache_e;
+	}
+}
+
+/*
+ * Expire entries, and evict entries over the limits in CLOCK order:
+ * An entry at the tail with credit gets a second chance with half of
+ * its credit, so one-off files do not push out frequently used files.
+ */
+void svf_cache_purge(svf_cache_handle *cache_h)
+{
+	svf_cache_entry *cache_e, *cache_e_next;
+	time_t wheel_time;
+	int purge_num = 0;
+
+	if (cache_h->wheel_time > cache_h->time_now) {
+		/* The clock went backward: Entries not due are linked again */
+		cache_h->wheel_time = cache_h->time_now;
+	}
+	if (cache_h->time_now - cache_h->wheel_time >=
+	    SVF_CACHE_WHEEL_SIZE * SVF_CACHE_WHEEL_SIZE) {
+		/* Idle for a round of the coarse wheel: Relink all entries
+		   instead of turning the wheels */
+		cache_h->wheel_time = cache_h->time_now;
+		for (cache_e = cache_h->list; cache_e; cache_e = cache_e->next) {
+			if (cache_e->wheel_pprev) {
+				svf_cache_wheel_unlink(cache_e);
+				svf_cache_wheel_link(cache_h, cache_e);
+			}
+		}
+	}
+
+	/* An entry is visited when it is due, when it is cascaded from the
+	   coarse wheel, and once per round of the coarse wheel (about 68
+	   min) while it is on the far list */
+	for (; cache_h->wheel_time <= cache_h->time_now; cache_h->wheel_time++) {
+		wheel_time = cache_h->wheel_time;
+		if (wheel_time % SVF_CACHE_WHEEL_SIZE == 0) {
+			time_t round = wheel_time / SVF_CACHE_WHEEL_SIZE;
+
+			if (round % SVF_CACHE_WHEEL_SIZE == 0) {
+				svf_cache_wheel_cascade(cache_h,
+					&cache_h->wheel_far);
+			}
+			svf_cache_wheel_cascade(cache_h,
+				&cache_h->wheel_coarse[round &
+				(SVF_CACHE_WHEEL_SIZE - 1)]);
+		}
+
+		cache_e = cache_h->wheel[wheel_time & (SVF_CACHE_WHEEL_SIZE - 1)];
+		for (; cache_e; cache_e = cache_e_next) {
+			cache_e_next = cache_e->wheel_next;
+			if (cache_e->expire <= cache_h->time_now) {
+				svf_cache_remove(cache_h, cache_e);
+				svf_cache_entry_free(cache_e);
+				purge_num++;
+			} else {
+				/* Linked before the clock went backward */
+				svf_cache_wheel_unlink(cache_e);
+				svf_cache_wheel_link(cache_h, cache_e);
+			}
+		}
+	}
+
+	while ((cache_h->entry_num > cache_h->entry_limit ||
+		(cache_h->size_limit > 0 && cache_h->mem_size > cache_h->size_limit)) &&
+	       cache_h->end) {
+		cache_e = cache_h->end;
+		if (cache_e == cache_h->list) {
+			/* Keep the entry just added */
+			break;
+		}
+		if (cache_e->credit > 0) {
+			cache_e->credit >>= 1;
+			svf_cache_rotate(cache_h, cache_e);
+			continue;
+		}
+		svf_cache_remove(cache_h, cache_e);
+		svf_cache_entry_free(cache_e);
+		purge_num++;
+	}
+
+	if (purge_num > 0) {
+		DEBUG(10,("Purged cache entries: %d\n", purge_num));
+	}
+}
+
+static bool svf_cache_link(svf_cache_handle *cache_h, svf_cache_entry *cache_e)
+{
+	time_t result_time_limit =
+		svf_cache_result_time_limit(cache_h, cache_e->result);
+
+	if (!svf_cache_entry_link_dir(cache_h, cache_e)) {
+		return false;
+	}
+
+	DLIST_ADD(cache_h->list, cache_e);
+	svf_cache_hash_link(cache_h, cache_e);
+
+	/* Validated entries are authoritative regardless of their age
+	   unless the result has its own time limit */
+	cache_e->expire = 0;
+	if (result_time_limit > 0) {
+		cache_e->expire = cache_e->time + result_time_limit;
+	}
+	if (!cache_e->has_validator &&
+	    (!cache_e->expire ||
+	     cache_e->time + cache_h->time_limit < cache_e->expire)) {
+		cache_e->expire = cache_e->time + cache_h->time_limit;
+	}
+	if (cache_e->expire) {
+		svf_cache_wheel_link(cache_h, cache_e);
+	}
+
+	/* Expensive results start with some credit */
+	cache_e->credit = cache_e->cost_level / 2;
+
+	cache_e->mem_size = svf_cache_entry_mem_size(cache_e);
+	cache_h->mem_size += cache_e->mem_size;
+	cache_h->entry_num++;
+	if (!cache_h->end) {
+		cache_h->end = cache_e;
+	}
+
+	svf_cache_purge(cache_h);
+
+	/* Keep the load factor <= 1 */
+	if (cache_h->entry_num > cache_h->hash_size &&
+	    cache_h->hash_size < SVF_CACHE_HASH_SIZE_MAX) {
+		svf_cache_hash_resize(cache_h, cache_h->hash_size * 2);
+	}
+
+	return true;
+}
+
+/* Import an entry from the shared caches into the local cache */
+static svf_cache_entry *svf_cache_import(
+	svf_cache_handle *cache_h,
+	const char *fname,
+	int fname_len,
+	const SMB_STRUCT_STAT *st,
+	const char *options)
+{
+	uint32_t generation = svf_cache_shared_generation(cache_h, options);
+	svf_cache_entry *cache_e;
+	svf_result result;
+	time_t time_scanned;
+	time_t result_time_limit;
+	char report[SVF_CACHE_REPORT_MAX];
+	bool is_shm = false;
+
+	/* Results of an unknown version might never be invalidated */
+	if (generation == 0) {
+		return NULL;
+	}
+
+	if (cache_h->shm_cache_h && svf_shm_cache_get(cache_h->shm_cache_h,
+	    generation, st, &result, &time_scanned, report, sizeof(report))) {
+		DEBUG(10,("Shared memory cache entry found: fname=%s\n", fname));
+		is_shm = true;
+	} else if (cache_h->tdb_cache_h && svf_tdb_cache_get(cache_h->tdb_cache_h,
+	    generation, st, &result, &time_scanned, report, sizeof(report))) {
+		DEBUG(10,("Persistent cache entry found: fname=%s\n", fname));
+	} else {
+		return NULL;
+	}
+
+	result_time_limit = svf_cache_result_time_limit(cache_h, result);
+	if (result_time_limit == 0 ||
+	    (result_time_limit > 0 &&
+	     cache_h->time_now - time_scanned >= result_time_limit)) {
+		return NULL;
+	}
+
+	cache_e = svf_cache_entry_new(cache_h, fname, fname_len);
+	if (!cache_e) {
+		return NULL;
+	}
+	cache_e->result = result;
+	if (!svf_cache_entry_set_report(cache_e, report)) {
+		svf_cache_entry_free(cache_e);
+		return NULL;
+	}
+	svf_cache_entry_set_validator(cache_e, st);
+	if (!cache_e->has_validator) {
+		svf_cache_entry_free(cache_e);
+		return NULL;
+	}
+	/* Just validated by the current state of the file */
+	svf_cache_entry_set_inval_seq(cache_e, st,
+		svf_cache_inval_seq(cache_h, st));
+	cache_e->generation = cache_h->generation;
+	/* Expires by the time limit as if it had been scanned here */
+	cache_e->time = time_scanned;
+
+	if (!is_shm && cache_h->shm_cache_h && cache_e->has_validator) {
+		svf_shm_cache_put(cache_h->shm_cache_h, generation, cache_e);
+	}
+
+	if (!svf_cache_link(cache_h, cache_e)) {
+		svf_cache_entry_free(cache_e);
+		return NULL;
+	}
+
+	return cache_e;
+}
+
+/* Results in the shared caches are looked up by the scan options, too */
+svf_cache_entry *svf_cache_get(
+	svf_cache_handle *cache_h,
+	const char *fname,
+	int fname_len,
+	const SMB_STRUCT_STAT *st,
+	const char *options)
+{
+	svf_cache_entry *cache_e;
+	uint32_t fname_hash;
+
+	cache_h->time_now = time(NULL);
+	svf_cache_purge(cache_h);
+
+	if (fname_len <= 0) {
+		fname_len = strlen(fname);
+	}
+	fname_hash = svf_cache_hash(fname, fname_len);
+
+	DEBUG(10,("Searching cache entry: fname=%s\n", fname));
+
+	for (cache_e = cache_h->hash_table[fname_hash & (cache_h->hash_size - 1)];
+	     cache_e;
+	     cache_e = cache_e->hash_next) {
+		if (cache_e->fname_hash == fname_hash &&
+		    cache_e->fname_len == fname_len &&
+		    memcmp(cache_e->fname, fname, fname_len) == 0) {
+			break;
+		}
+	}
+
+	if (cache_e && !svf_cache_entry_is_valid(cache_h, cache_e, st)) {
+		DEBUG(10,("Cache entry is stale: fname=%s\n", fname));
+		svf_cache_remove(cache_h, cache_e);
+		svf_cache_entry_free(cache_e);
+		cache_e = NULL;
+	}
+
+	if (cache_e) {
+		/* Each hit saves a scan as expensive as the first one */
+		cache_e->credit = MIN(SVF_CACHE_CREDIT_MAX,
+			cache_e->credit + 1 + cache_e->cost_level);
+	}
+
+	if (!cache_e && (cache_h->shm_cache_h || cache_h->tdb_cache_h) &&
+	    cache_h->entry_limit > 0 && st && VALID_STAT(*st)) {
+		cache_e = svf_cache_import(cache_h, fname, fname_len, st, options);
+	}
+
+	return cache_e;
+}
+
+void svf_cache_add(
+	svf_cache_handle *cache_h,
+	svf_cache_entry *cache_e,
+	const char *options)
+{
+	if (cache_h->entry_limit <= 0 ||
+	    svf_cache_result_time_limit(cache_h, cache_e->result) == 0) {
+		DEBUG(10,("Not caching result %d: %s\n",
+			cache_e->result, cache_e->fname));
+		svf_cache_entry_free(cache_e);
+		return;
+	}
+
+	/* The clock sampled by svf_cache_get() */
+	cache_e->time = cache_h->time_now;
+	cache_e->generation = cache_h->generation;
+
+	if (cache_e->has_validator &&
+	    (cache_e->result == SVF_RESULT_CLEAN ||
+	     cache_e->result == SVF_RESULT_INFECTED)) {
+		uint32_t generation = svf_cache_shared_generation(cache_h,
+			options);
+
+		/* Not shared until the scanner version is known: A
+		   signature update could not invalidate the result */
+		if (generation == 0 &&
+		    (cache_h->shm_cache_h || cache_h->tdb_cache_h)) {
+			DEBUG(10,("Not sharing result of unknown scanner "
+				"version: %s\n", cache_e->fname));
+		}
+		if (generation != 0 && cache_h->shm_cache_h) {
+			svf_shm_cache_put(cache_h->shm_cache_h, generation,
+				cache_e);
+		}
+		if (generation != 0 && cache_h->tdb_cache_h) {
+			svf_tdb_cache_put(cache_h->tdb_cache_h, generation,
+				cache_e);
+		}
+	}
+
+	if (!svf_cache_link(cache_h, cache_e)) {
+		svf_cache_entry_free(cache_e);
+	}
+}
+
+void svf_cache_remove(svf_cache_handle *cache_h, svf_cache_entry *cache_e)
+{
+	if (cache_h->end == cache_e) {
+		/* Newer DLIST keeps the tail in the head's prev */
+		cache_h->end = (cache_e == cache_h->list) ? NULL : cache_e->prev;
+	}
+	cache_h->entry_num--;
+	cache_h->mem_size -= cache_e->mem_size;
+	DLIST_REMOVE(cache_h->list, cache_e);
+	svf_cache_hash_unlink(cache_e);
+	svf_cache_wheel_unlink(cache_e);
+	svf_cache_dir_unref(cache_h, cache_e->dir);
+	cache_e->dir = NULL;
+}
+
+/*
+ * Invalidate entries of files under the directory renamed or removed.
+ * The entries are dropped when they are looked up or evicted.
+ */
+void svf_cache_remove_dir(svf_cache_handle *cache_h, const char *dname)
+{
+	svf_cache_dir *dir;
+
+	if (!svf_cache_dir_get(cache_h, dname, strlen(dname), false, &dir) ||
+	    !dir) {
+		return;
+	}
+
+	DEBUG(10,("Invalidating cache entries under directory: %s\n", dname));
+
+	dir->dead = true;
+	/* A new directory with the same name gets a new node */
+	svf_cache_dir_hash_unlink(cache_h, dir);
+	svf_cache_dir_unref(cache_h, dir);
+}
+
+void svf_cache_flush(svf_cache_handle *cache_h)
+{
+	svf_cache_entry *cache_e;
+
+	DEBUG(10,("Flushing cache entries\n"));
+
+	while ((cache_e = cache_h->list) != NULL) {
+		svf_cache_remove(cache_h, cache_e);
+		svf_cache_entry_free(cache_e);
+	}
+}
+
+/*
+ * Set the version of the scanner and its signature database.
+ * Entries scanned with another version are flushed, and those in the
+ * shared caches are ignored. Returns true if the version changed.
+ */
+bool svf_cache_set_version(svf_cache_handle *cache_h, const char *version)
+{
+	uint32_t generation = svf_cache_hash(version, strlen(version));
+
+	if (generation == 0) {
+		/* 0 is reserved for unknown version */
+		generation = 1;
+	}
+	if (generation == cache_h->generation) {
+		return false;
+	}
+
+	svf_cache_flush(cache_h);
+	cache_h->generation = generation;
+
+	return true;
+}
+
+/*
+ * Return the generation of results shared with other processes or kept
+ * in extended attributes: A verdict depends on the scan options (e.g.,
+ * "scan archive") as well as the version. 0 if the version is unknown.
+ */
+uint32_t svf_cache_shared_generation(
+	const svf_cache_handle *cache_h,
+	const char *options)
+{
+	uint32_t id[2];
+	uint32_t generation;
+
+	if (cache_h->generation == 0) {
+		return 0;
+	}
+
+	id[0] = cache_h->generation;
+	id[1] = options ? svf_cache_hash(options, strlen(options)) : 0;
+	generation = svf_cache_hash((const char *)id, sizeof(id));
+
+	return (generation == 0) ? 1 : generation;
+}
+
+/* Shared cache for all smbd processes
+ * ---------------------------------------------------------------------- */
+
+svf_shm_cache_handle *svf_shm_cache_new(
+	TALLOC_CTX *mem_ctx,
+	const char *path,
+	int entry_limit)
+{
+	svf_shm_cache_handle *shm_cache_h;
+	uint32_t slot_num = SVF_CACHE_HASH_SIZE_MIN;
+
+	while (slot_num < entry_limit && slot_num < SVF_CACHE_HASH_SIZE_MAX) {
+		slot_num *= 2;
+	}
+
+	shm_cache_h = TALLOC_ZERO_P(mem_ctx, svf_shm_cache_handle);
+	if (!shm_cache_h) {
+		DEBUG(0,("TALLOC_ZERO_P failed\n"));
+		return NULL;
+	}
+
+	shm_cache_h->shm_h = svf_shm_new(shm_cache_h, path,
+		SVF_SHM_CACHE_MAGIC, slot_num * sizeof(svf_shm_cache_slot));
+	if (!shm_cache_h->shm_h) {
+		TALLOC_FREE(shm_cache_h);
+		return NULL;
+	}
+
+	/* An existing file may have a different number of slots */
+	slot_num = shm_cache_h->shm_h->data_size / sizeof(svf_shm_cache_slot);
+	if (slot_num == 0 || (slot_num & (slot_num - 1)) != 0 ||
+	    shm_cache_h->shm_h->data_size != slot_num * sizeof(svf_shm_cache_slot)) {
+		DEBUG(0,("Invalid shared cache file: %s\n", path));
+		TALLOC_FREE(shm_cache_h);
+		return NULL;
+	}
+
+	shm_cache_h->slots = shm_cache_h->shm_h->data;
+	shm_cache_h->slot_num = slot_num;
+
+	DEBUG(5,("Shared cache attached: %s: %lu slots\n",
+		path, (unsigned long)slot_num));
+
+	return shm_cache_h;
+}
+
+void svf_cache_set_shm(svf_cache_handle *cache_h, svf_shm_cache_handle *shm_cache_h)
+{
+	cache_h->shm_cache_h = shm_cache_h;
+}
+
+/* Invalidation by other smbd processes
+ * ---------------------------------------------------------------------- */
+
+svf_cache_inval_handle *svf_cache_inval_new(
+	TALLOC_CTX *mem_ctx,
+	const char *path)
+{
+	svf_cache_inval_handle *inval_h;
+	uint32_t counter_num;
+
+	inval_h = TALLOC_ZERO_P(mem_ctx, svf_cache_inval_handle);
+	if (!inval_h) {
+		DEBUG(0,("TALLOC_ZERO_P failed\n"));
+		return NULL;
+	}
+
+	inval_h->shm_h = svf_shm_new(inval_h, path, SVF_CACHE_INVAL_MAGIC,
+		SVF_CACHE_INVAL_COUNTER_NUM * sizeof(uint32_t));
+	if (!inval_h->shm_h) {
+		TALLOC_FREE(inval_h);
+		return NULL;
+	}
+
+	counter_num = inval_h->shm_h->data_size / sizeof(uint32_t);
+	if (counter_num == 0 || (counter_num & (counter_num - 1)) != 0 ||
+	    inval_h->shm_h->data_size != counter_num * sizeof(uint32_t)) {
+		DEBUG(0,("Invalid cache invalidation file: %s\n", path));
+		TALLOC_FREE(inval_h);
+		return NULL;
+	}
+
+	inval_h->counters = inval_h->shm_h->data;
+	inval_h->counter_num = counter_num;
+
+	DEBUG(5,("Cache invalidation counters attached: %s\n", path));
+
+	return inval_h;
+}
+
+void svf_cache_set_inval(svf_cache_handle *cache_h, svf_cache_inval_handle *inval_h)
+{
+	cache_h->inval_h = inval_h;
+}
+
+/* Sample the invalidation counter of a file before scanning it */
+uint32_t svf_cache_inval_seq(svf_cache_handle *cache_h, const SMB_STRUCT_STAT *st)
+{
+	if (!cache_h->inval_h || !st || !VALID_STAT(*st)) {
+		return 0;
+	}
+
+	return *svf_cache_inval_counter(cache_h->inval_h,
+		st->st_ex_dev, st->st_ex_ino);
+}
+
+/* Invalidate cached results of a file in all processes */
+void svf_cache_invalidate(svf_cache_inval_handle *inval_h, const SMB_STRUCT_STAT *st)
+{
+	if (!st || !VALID_STAT(*st)) {
+		return;
+	}
+
+	__sync_fetch_and_add(svf_cache_inval_counter(inval_h,
+		st->st_ex_dev, st->st_ex_ino), 1);
+}
+
+/* Persistent cache for all smbd processes
+ * ---------------------------------------------------------------------- */
+
+svf_tdb_cache_handle *svf_tdb_cache_new(
+	TALLOC_CTX *mem_ctx,
+	const char *path,
+	off_t size_limit)
+{
+	svf_tdb_cache_handle *tdb_cache_h;
+
+	tdb_cache_h = TALLOC_ZERO_P(mem_ctx, svf_tdb_cache_handle);
+	if (!tdb_cache_h) {
+		DEBUG(0,("TALLOC_ZERO_P failed\n"));
+		return NULL;
+	}
+
+	tdb_cache_h->path = talloc_strdup(tdb_cache_h, path);
+	if (!tdb_cache_h->path) {
+		DEBUG(0,("talloc_strdup failed\n"));
+		TALLOC_FREE(tdb_cache_h);
+		return NULL;
+	}
+	tdb_cache_h->size_limit = size_limit;
+
+	/* Records are read lazily on cache misses */
+	tdb_cache_h->tdb_w = tdb_wrap_open(tdb_cache_h, path, 10007,
+		TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+	if (!tdb_cache_h->tdb_w) {
+		DEBUG(0,("Opening persistent cache failed: %s: %s\n",
+			path, strerror(errno)));
+		TALLOC_FREE(tdb_cache_h);
+		return NULL;
+	}
+
+	DEBUG(5,("Persistent cache opened: %s\n", path));
+
+	return tdb_cache_h;
+}
+
+/*
+ * Same records in a dbwrap database: A CTDB database distributed to
+ * all cluster nodes if clustering is enabled, a local tdb otherwise.
+ * Records are keyed by the device and inode, as in locking.tdb, so the
+ * nodes must see the same numbers (see vfs_fileid).
+ */
+svf_tdb_cache_handle *svf_db_cache_new(
+	TALLOC_CTX *mem_ctx,
+	const char *path,
+	off_t size_limit)
+{
+	svf_tdb_cache_handle *tdb_cache_h;
+
+	tdb_cache_h = TALLOC_ZERO_P(mem_ctx, svf_tdb_cache_handle);
+	if (!tdb_cache_h) {
+		DEBUG(0,("TALLOC_ZERO_P failed\n"));
+		return NULL;
+	}
+
+	tdb_cache_h->path = talloc_strdup(tdb_cache_h, path);
+	if (!tdb_cache_h->path) {
+		DEBUG(0,("talloc_strdup failed\n"));
+		TALLOC_FREE(tdb_cache_h);
+		return NULL;
+	}
+	tdb_cache_h->size_limit = size_limit;
+
+	tdb_cache_h->db = db_open(tdb_cache_h, path, 10007,
+		TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+	if (!tdb_cache_h->db) {
+		DEBUG(0,("Opening cluster cache failed: %s: %s\n",
+			path, strerror(errno)));
+		TALLOC_FREE(tdb_cache_h);
+		return NULL;
+	}
+
+	DEBUG(5,("Cluster cache opened: %s\n", path));
+
+	return tdb_cache_h;
+}
+
+struct svf_tdb_cache_compact_state {
+	int64_t		time_cutoff;
+	int64_t		time_min;
+	off_t		data_size;
+	int		deleted_num;
+};
+
+/* Return true if the record should be deleted */
+static bool svf_tdb_cache_compact_record(
+	struct svf_tdb_cache_compact_state *state,
+	TDB_DATA key,
+	TDB_DATA data)
+{
+	svf_tdb_cache_record record;
+
+	if (key.dsize != sizeof(uint64_t) * 2) {
+		/* Not a cache record */
+		return false;
+	}
+
+	if (data.dsize <= sizeof(record)) {
+		record.version = 0;
+	} else {
+		memcpy(&record, data.dptr, sizeof(record));
+	}
+
+	/* Generation 0 (unknown scanner version) is no longer stored */
+	if (record.version != SVF_TDB_CACHE_VERSION ||
+	    record.generation == 0 ||
+	    record.time < state->time_cutoff) {
+		state->deleted_num++;
+		return true;
+	}
+
+	state->data_size += key.dsize + data.dsize;
+	if (record.time < state->time_min) {
+		state->time_min = record.time;
+	}
+
+	return false;
+}
+
+static int svf_tdb_cache_compact_traverse(
+	struct tdb_context *tdb,
+	TDB_DATA key,
+	TDB_DATA data,
+	void *private_data)
+{
+	struct svf_tdb_cache_compact_state *state = private_data;
+
+	if (svf_tdb_cache_compact_record(state, key, data)) {
+		tdb_delete(tdb, key);
+	}
+
+	return 0;
+}
+
+static int svf_db_cache_compact_traverse(
+	struct db_record *rec,
+	void *private_data)
+{
+	struct svf_tdb_cache_compact_state *state = private_data;
+
+	if (svf_tdb_cache_compact_record(state, rec->key, rec->value)) {
+		rec->delete_rec(rec);
+	}
+
+	return 0;
+}
+
+/*
+ * Drop the older half (by age) of the records until the records fit in
+ * the size limit. The file does not shrink, but tdb reuses the freed
+ * space, so it stays around the limit. Not repacked: tdb_repack() locks
+ * the whole database for all smbd processes.
+ */
+int svf_tdb_cache_compact(svf_tdb_cache_handle *tdb_cache_h)
+{
+	struct svf_tdb_cache_compact_state state;
+	int ret;
+	int64_t time_now = time(NULL);
+	int deleted_num = 0;
+	int round;
+
+	ZERO_STRUCT(state);
+
+	for (round = 0; round < 8; round++) {
+		state.time_min = INT64_MAX;
+		state.data_size = 0;
+		state.deleted_num = 0;
+		if (tdb_cache_h->db) {
+			ret = tdb_cache_h->db->traverse(tdb_cache_h->db,
+				svf_db_cache_compact_traverse, &state);
+		} else {
+			ret = tdb_traverse(tdb_cache_h->tdb_w->tdb,
+				svf_tdb_cache_compact_traverse, &state);
+		}
+		if (ret == -1) {
+			DEBUG(0,("Traversing persistent cache failed: %s\n",
+				tdb_cache_h->path));
+			return -1;
+		}
+		deleted_num += state.deleted_num;
+
+		DEBUG(5,("Persistent cache size: %s: %lld bytes\n",
+			tdb_cache_h->path, (long long)state.data_size));
+
+		if (tdb_cache_h->size_limit <= 0 ||
+		    state.data_size <= tdb_cache_h->size_limit ||
+		    state.time_min == INT64_MAX) {
+			break;
+		}
+
+		state.time_cutoff = state.time_min + (time_now - state.time_min) / 2 + 1;
+	}
+
+	if (deleted_num > 0) {
+		DEBUG(3,("Persistent cache compacted: %s: %d records deleted\n",
+			tdb_cache_h->path, deleted_num));
+	}
+
+	return 0;
+}
+
+void svf_cache_set_tdb(svf_cache_handle *cache_h, svf_tdb_cache_handle *tdb_cache_h)
+{
+	cache_h->tdb_cache_h = tdb_cache_h;
+}
+
+/* Scanner backends
+ * ====================================================================== */
+
+/* Attach the state of backends shared by smbd processes, or use a state
+   local to this process if the shared memory is not available */
+svf_backend_table_handle *svf_backend_table_new(
+	TALLOC_CTX *mem_ctx,
+	const char *path)
+{
+	svf_backend_table_handle *table_h;
+
+	table_h = TALLOC_ZERO_P(mem_ctx, svf_backend_table_handle);
+	if (!table_h) {
+		DEBUG(0,("TALLOC_ZERO_P failed\n"));
+		return NULL;
+	}
+
+	table_h->shm_h = svf_shm_new(table_h, path, SVF_BACKEND_MAGIC,
+		SVF_BACKEND_SLOT_NUM * sizeof(svf_backend_slot));
+	if (table_h->shm_h &&
+	    table_h->shm_h->data_size ==
+	    SVF_BACKEND_SLOT_NUM * sizeof(svf_backend_slot)) {
+		table_h->slots = table_h->shm_h->data;
+		DEBUG(5,("Scanner backend state attached: %s\n", path));
+	} else {
+		DEBUG(0,("Attaching scanner backend state failed: %s: "
+			"Using state local to this process\n", path));
+		TALLOC_FREE(table_h->shm_h);
+		table_h->slots = TALLOC_ZERO_ARRAY(table_h, svf_backend_slot,
+			SVF_BACKEND_SLOT_NUM);
+		if (!table_h->slots) {
+			DEBUG(0,("TALLOC_ZERO_ARRAY failed\n"));
+			TALLOC_FREE(table_h);
+			return NULL;
+		}
+	}
+	table_h->slot_num = SVF_BACKEND_SLOT_NUM;
+
+	return table_h;
+}
+
+svf_backend_slot *svf_backend_slot_get(
+	svf_backend_table_handle *table_h,
+	const char *path)
+{
+	uint32_t hash = svf_cache_hash(path, strlen(path));
+
+	return &table_h->slots[hash & (table_h->slot_num - 1)];
+}
+
+svf_backend_state svf_backend_state_get(svf_backend_slot *slot)
+{
+	uint32_t now = (uint32_t)time(NULL);
+	uint32_t open_until = slot->open_until;
+
+	if (open_until == 0) {
+		return SVF_BACKEND_CLOSED;
+	}
+	if (now < open_until || now < slot->probe_until) {
+		/* Retry time not yet come, or another process is probing */
+		return SVF_BACKEND_OPEN;
+	}
+
+	return SVF_BACKEND_HALF_OPEN;
+}
+
+/* Take the probe of a half-open backend. A probe not finished by its
+   deadline (e.g., the process died) is taken over by another process. */
+static bool svf_backend_probe_take(svf_backend_slot *slot, int retry_interval)
+{
+	uint32_t now = (uint32_t)time(NULL);
+	uint32_t probe_until = slot->probe_until;
+
+	if (svf_backend_state_get(slot) != SVF_BACKEND_HALF_OPEN) {
+		return false;
+	}
+
+	return __sync_bool_compare_and_swap(&slot->probe_until,
+		probe_until, now + retry_interval);
+}
+
+/* Return the index of the backend with the fewest scans in progress in
+   all processes, skipping the open backends and the backend at index
+   exclude, or -1 if none is available. A half-open backend is probed by
+   the next scan of one process while the others keep failing fast. */
+int svf_backend_select(
+	svf_backend_table_handle *table_h,
+	const char **paths,
+	int path_num,
+	int exclude,
+	int retry_interval)
+{
+	static uint32_t rotor = 0; /* Spread ties over the backends */
+	int best = -1;
+	uint32_t best_outstanding = 0;
+	int n;
+
+	rotor++;
+	for (n = 0; n < path_num; n++) {
+		int i = (n + rotor) % path_num;
+		svf_backend_slot *slot = svf_backend_slot_get(table_h, paths[i]);
+		uint32_t outstanding;
+
+		if (i == exclude) {
+			continue;
+		}
+		if (slot->open_until != 0) {
+			if (!svf_backend_probe_take(slot, retry_interval)) {
+				continue;
+			}
+			DEBUG(3,("Probing scanner backend: %s\n", paths[i]));
+			return i;
+		}
+
+		outstanding = slot->outstanding;
+		if (best == -1 || outstanding < best_outstanding) {
+			best = i;
+			best_outstanding = outstanding;
+		}
+	}
+
+	return best;
+}
+
+void svf_backend_begin(svf_backend_slot *slot)
+{
+	__sync_fetch_and_add(&slot->outstanding, 1);
+}
+
+/* Finish a scan on a backend without an outcome (e.g., the loser of a
+   hedged request): The circuit breaker is left as is */
+void svf_backend_cancel(svf_backend_slot *slot)
+{
+	uint32_t outstanding;
+
+	/* Never below 0 */
+	do {
+		outstanding = slot->outstanding;
+	} while (outstanding > 0 &&
+		 !__sync_bool_compare_and_swap(&slot->outstanding,
+		 outstanding, outstanding - 1));
+}
+
+/* Finish a scan on a backend. The breaker trips after error_limit
+   (0: never) consecutive failures, and is reset by any successful
+   scan (the probe of a half-open backend). A failed probe keeps it
+   open for another retry_interval. */
+svf_backend_event svf_backend_end(
+	svf_backend_slot *slot,
+	bool failed,
+	int error_limit,
+	int retry_interval)
+{
+	uint32_t now = (uint32_t)time(NULL);
+	uint32_t open_until;
+
+	svf_backend_cancel(slot);
+
+	if (!failed) {
+		if (slot->error_count != 0) {
+			slot->error_count = 0;
+		}
+		open_until = slot->open_until;
+		if (open_until != 0 &&
+		    __sync_bool_compare_and_swap(&slot->open_until,
+		    open_until, 0)) {
+			slot->probe_until = 0;
+			return SVF_BACKEND_EVENT_RESET;
+		}
+		return SVF_BACKEND_EVENT_NONE;
+	}
+
+	if (error_limit <= 0 ||
+	    __sync_add_and_fetch(&slot->error_count, 1) < (uint32_t)error_limit) {
+		return SVF_BACKEND_EVENT_NONE;
+	}
+
+	open_until = slot->open_until;
+	slot->open_until = now + retry_interval;
+	slot->probe_until = 0;
+
+	return (open_until == 0) ?
+		SVF_BACKEND_EVENT_TRIPPED : SVF_BACKEND_EVENT_NONE;
+}
+
+/* Content hash
+ * ====================================================================== */
+
+/*
+ * Compute the SHA-256 digest of the file in hex. Fails if the file is
+ * not the one described by st, because the scan result is keyed by the
+ * content hashed here.
+ */
+int svf_file_digest(const char *path, const SMB_STRUCT_STAT *st, char *hex)
+{
+	SHA256_CTX ctx;
+	uint8_t digest[SVF_DIGEST_SIZE];
+	struct stat fst;
+	char *buf = NULL;
+	off_t read_total = 0;
+	ssize_t read_size;
+	int fd, i;
+	int ret = -1;
+
+	fd = open(path, O_RDONLY|O_NOCTTY|O_NONBLOCK);
+	if (fd == -1) {
+		DEBUG(3,("Opening file to hash failed: %s: %s\n",
+			path, strerror(errno)));
+		return -1;
+	}
+
+	if (fstat(fd, &fst) == -1) {
+		DEBUG(3,("fstat failed: %s: %s\n", path, strerror(errno)));
+		goto svf_file_digest_done;
+	}
+	if (!S_ISREG(fst.st_mode) ||
+	    fst.st_dev != st->st_ex_dev ||
+	    fst.st_ino != st->st_ex_ino ||
+	    fst.st_size != st->st_ex_size ||
+	    fst.st_mtime != st->st_ex_mtime.tv_sec) {
+		DEBUG(5,("File changed before hashing: %s\n", path));
+		goto svf_file_digest_done;
+	}
+
+	/* Read instead of mmap(2): Truncating the file by another client
+	   while hashing must not kill smbd by SIGBUS */
+	buf = (char *)talloc_size(talloc_tos(), SVF_DIGEST_READ_SIZE);
+	if (!buf) {
+		DEBUG(0,("talloc_size failed\n"));
+		goto svf_file_digest_done;
+	}
+
+	SHA256_Init(&ctx);
+	while ((read_size = read(fd, buf, SVF_DIGEST_READ_SIZE)) != 0) {
+		if (read_size == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			DEBUG(3,("Reading file to hash failed: %s: %s\n",
+				path, strerror(errno)));
+			goto svf_file_digest_done;
+		}
+		SHA256_Update(&ctx, buf, read_size);
+		read_total += read_size;
+	}
+	SHA256_Final(digest, &ctx);
+
+	if (read_total != fst.st_size) {
+		DEBUG(5,("File changed while hashing: %s\n", path));
+		goto svf_file_digest_done;
+	}
+
+	for (i = 0; i < SVF_DIGEST_SIZE; i++) {
+		snprintf(hex + i * 2, 3, "%02x", digest[i]);
+	}
+	ret = 0;
+
+svf_file_digest_done:
+	TALLOC_FREE(buf);
+	close(fd);
+
+	return ret;
+}
+
+/* Scan result in extended attribute
+ * ====================================================================== */
+
+/* Load the MAC key, or create it if it does not exist */
+int svf_xattr_key_load(const char *path, uint8_t *key)
+{
+	char *path_tmp = NULL;
+	ssize_t io_size;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 && errno == ENOENT) {
+		path_tmp = talloc_asprintf(talloc_tos(), "%s.%ld",
+			path, (long)getpid());
+		if (!path_tmp) {
+			DEBUG(0,("talloc_asprintf failed\n"));
+			return -1;
+		}
+
+		generate_random_buffer(key, SVF_XATTR_KEY_SIZE);
+
+		fd = open(path_tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		if (fd == -1) {
+			DEBUG(0,("Creating key file failed: %s: %s\n",
+				path_tmp, strerror(errno)));
+			TALLOC_FREE(path_tmp);
+			return -1;
+		}
+		io_size = write(fd, key, SVF_XATTR_KEY_SIZE);
+		close(fd);
+
+		/* link(2) fails if another process has created the key */
+		if (io_size == SVF_XATTR_KEY_SIZE && link(path_tmp, path) == 0) {
+			unlink(path_tmp);
+			TALLOC_FREE(path_tmp);
+			DEBUG(3,("Key file created: %s\n", path));
+			return 0;
+		}
+		unlink(path_tmp);
+		TALLOC_FREE(path_tmp);
+
+		fd = open(path, O_RDONLY);
+	}
+	if (fd == -1) {
+		DEBUG(0,("Opening key file failed: %s: %s\n",
+			path, strerror(errno)));
+		return -1;
+	}
+
+	io_size = read(fd, key, SVF_XATTR_KEY_SIZE);
+	close(fd);
+	if (io_size != SVF_XATTR_KEY_SIZE) {
+		DEBUG(0,("Invalid key file: %s\n", path));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void svf_xattr_verdict_mac(
+	const svf_xattr_verdict *verdict,
+	const uint8_t *key,
+	uint8_t *mac)
+{
+	struct HMACSHA256Context ctx;
+
+	hmac_sha256_init(key, SVF_XATTR_KEY_SIZE, &ctx);
+	hmac_sha256_update((const uint8_t *)verdict,
+		offsetof(svf_xattr_verdict, mac), &ctx);
+	hmac_sha256_final(mac, &ctx);
+}
+
+static void svf_xattr_verdict_fill(
+	svf_xattr_verdict *verdict,
+	const char *engine,
+	uint32_t generation,
+	const SMB_STRUCT_STAT *st)
+{
+	ZERO_STRUCTP(verdict);
+	verdict->version = SVF_XATTR_VERDICT_VERSION;
+	verdict->generation = generation;
+	strlcpy(verdict->engine, engine, sizeof(verdict->engine));
+	/* Device numbers differ on cluster nodes sharing the file system */
+	verdict->ino = st->st_ex_ino;
+	verdict->size = st->st_ex_size;
+	verdict->mtime_sec = st->st_ex_mtime.tv_sec;
+	verdict->mtime_nsec = st->st_ex_mtime.tv_nsec;
+}
+
+/* Sign a verdict stamped with the ctime in st, which must have been
+   updated just before by the file system (e.g., by setting the xattr) */
+void svf_xattr_verdict_set(
+	svf_xattr_verdict *verdict,
+	const uint8_t *key,
+	const char *engine,
+	uint32_t generation,
+	const SMB_STRUCT_STAT *st)
+{
+	svf_xattr_verdict_fill(verdict, engine, generation, st);
+	verdict->ctime_sec = st->st_ex_ctime.tv_sec;
+	verdict->ctime_nsec = st->st_ex_ctime.tv_nsec;
+	svf_xattr_verdict_mac(verdict, key, verdict->mac);
+}
+
+bool svf_xattr_verdict_check(
+	const svf_xattr_verdict *verdict,
+	const uint8_t *key,
+	const char *engine,
+	uint32_t generation,
+	const SMB_STRUCT_STAT *st)
+{
+	svf_xattr_verdict verdict_expected;
+	int64_t ctime_diff;
+	uint8_t diff = 0;
+	int i;
+
+	svf_xattr_verdict_fill(&verdict_expected, engine, generation, st);
+	verdict_expected.ctime_sec = verdict->ctime_sec;
+	verdict_expected.ctime_nsec = verdict->ctime_nsec;
+
+	/* Any change but setting the xattr itself updates ctime later.
+	   Both are by the clock of the file system, not of this host */
+	ctime_diff = ((int64_t)st->st_ex_ctime.tv_sec - verdict->ctime_sec) *
+		1000000000 + ((int64_t)st->st_ex_ctime.tv_nsec -
+		verdict->ctime_nsec);
+	if (ctime_diff < 0 || ctime_diff > SVF_XATTR_CTIME_SLACK_NSEC) {
+		return false;
+	}
+
+	svf_xattr_verdict_mac(&verdict_expected, key, verdict_expected.mac);
+
+	/* Constant-time comparison */
+	for (i = 0; i < sizeof(svf_xattr_verdict); i++) {
+		diff |= ((const uint8_t *)verdict)[i] ^
+			((const uint8_t *)&verdict_expected)[i];
+	}
+
+	return (diff == 0);
 }
 
 /* Environment variable handling for execle(2)